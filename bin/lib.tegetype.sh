@@ -36,6 +36,7 @@ set_lib_var_names () {
     [ ! -r $lib_settings_sh ] || source $lib_settings_sh
     lib_csv=$BASE_DIR/data/lib.$1.csv
     lib_fa=$BASE_DIR/data/lib.$1.fa
+    lib_kmer_filter=$BASE_DIR/data/lib.$1.kmers
     lib_bt2_idx=$BASE_DIR/data/lib.$ref_name+$1
 }
 
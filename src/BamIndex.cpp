@@ -0,0 +1,264 @@
+#include "BamIndex.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+
+namespace
+{
+  inline unsigned long long int
+  get_le(const char * p, int n)
+  {
+    unsigned long long int res = 0;
+    for (int i = n - 1; i >= 0; --i) res = (res << 8) | (unsigned char)p[i];
+    return res;
+  }
+
+  const unsigned pseudo_bin = 37450;
+
+  // bins that may hold records overlapping the 0-based interval [beg, end)
+  void
+  reg2bins(long long int beg, long long int end, vector<unsigned>& res)
+  {
+    static const int shift[] = { 26, 23, 20, 17, 14 };
+    static const unsigned first[] = { 1, 9, 73, 585, 4681 };
+    res.clear();
+    res.push_back(0);
+    --end;
+    for (int l = 0; l < 5; ++l)
+      for (long long int k = first[l] + (beg >> shift[l]); k <= first[l] + (end >> shift[l]); ++k)
+	res.push_back(k);
+  }
+}
+
+
+BgzfReader::BgzfReader()
+  : f_(NULL), block_off_(-1), next_block_off_(0), pos_(0), eof_(false), n_blocks_(0)
+{
+  memset(&zs_, 0, sizeof(zs_));
+  if (inflateInit2(&zs_, -15) != Z_OK) {
+    cerr << "error: inflateInit2 failed" << endl;
+    exit(1);
+  }
+}
+
+BgzfReader::~BgzfReader()
+{
+  if (f_ != NULL) fclose(f_);
+  inflateEnd(&zs_);
+}
+
+bool
+BgzfReader::open(const string& name)
+{
+  name_ = name;
+  f_ = fopen(name.c_str(), "rb");
+  return f_ != NULL;
+}
+
+bool
+BgzfReader::load_block(long long int off)
+{
+  if (fseeko(f_, off, SEEK_SET) != 0) {
+    cerr << "error: cannot seek in BGZF file [" << name_ << "]" << endl;
+    exit(1);
+  }
+  block_off_ = off;
+  data_.clear();
+  pos_ = 0;
+  char h[12];
+  size_t n = fread(h, 1, 12, f_);
+  if (n == 0) {
+    next_block_off_ = off;
+    return false;
+  }
+  if (n < 12 or (unsigned char)h[0] != 31 or (unsigned char)h[1] != 139
+      or (unsigned char)h[2] != 8 or (h[3] & 4) == 0) {
+    cerr << "error: not a BGZF block at offset " << off << " in [" << name_ << "]" << endl;
+    exit(1);
+  }
+  size_t xlen = get_le(h + 10, 2);
+  raw_.resize(xlen);
+  if (fread(&raw_[0], 1, xlen, f_) != xlen) {
+    cerr << "error: truncated BGZF block at offset " << off << " in [" << name_ << "]" << endl;
+    exit(1);
+  }
+  // find the BC subfield, which holds the total block size - 1
+  long long int bsize = -1;
+  for (size_t i = 0; i + 4 <= xlen; i += 4 + get_le(&raw_[i + 2], 2)) {
+    if (raw_[i] == 'B' and raw_[i + 1] == 'C' and get_le(&raw_[i + 2], 2) == 2 and i + 6 <= xlen)
+      bsize = get_le(&raw_[i + 4], 2) + 1;
+  }
+  if (bsize < (long long int)(12 + xlen + 8)) {
+    cerr << "error: BGZF block without size at offset " << off << " in [" << name_ << "]" << endl;
+    exit(1);
+  }
+  size_t rest = bsize - 12 - xlen;
+  raw_.resize(rest);
+  if (fread(&raw_[0], 1, rest, f_) != rest) {
+    cerr << "error: truncated BGZF block at offset " << off << " in [" << name_ << "]" << endl;
+    exit(1);
+  }
+  next_block_off_ = off + bsize;
+  ++n_blocks_;
+
+  size_t isize = get_le(&raw_[rest - 4], 4);
+  data_.resize(isize);
+  if (isize > 0) {
+    inflateReset(&zs_);
+    zs_.next_in = (Bytef *)&raw_[0];
+    zs_.avail_in = rest - 8;
+    zs_.next_out = (Bytef *)&data_[0];
+    zs_.avail_out = isize;
+    if (inflate(&zs_, Z_FINISH) != Z_STREAM_END or zs_.avail_out != 0) {
+      cerr << "error: bad BGZF block at offset " << off << " in [" << name_ << "]" << endl;
+      exit(1);
+    }
+  }
+  return true;
+}
+
+bool
+BgzfReader::fill()
+{
+  while (not eof_ and pos_ >= data_.size()) {
+    if (not load_block(block_off_ < 0? 0 : next_block_off_))
+      eof_ = true;
+  }
+  return not eof_;
+}
+
+void
+BgzfReader::seek(VOffset v)
+{
+  long long int off = v >> 16;
+  eof_ = false;
+  if (off != block_off_ and not load_block(off))
+    eof_ = true;
+  pos_ = v & 0xffff;
+}
+
+VOffset
+BgzfReader::tell()
+{
+  if (not fill()) return (VOffset)next_block_off_ << 16;
+  return ((VOffset)block_off_ << 16) | pos_;
+}
+
+bool
+BgzfReader::eof()
+{
+  return not fill();
+}
+
+bool
+BgzfReader::read(size_t n, string& s)
+{
+  s.clear();
+  while (s.size() < n) {
+    if (not fill()) return false;
+    size_t len = min(n - s.size(), data_.size() - pos_);
+    s.append(data_, pos_, len);
+    pos_ += len;
+  }
+  return true;
+}
+
+
+bool
+BamIndex::load(const string& name)
+{
+  ifstream in(name.c_str(), ios::binary);
+  if (!in) return false;
+  string s((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  size_t i = 0;
+  // a read past the end means the index is malformed
+  auto get = [&] (int n) {
+    if (i + n > s.size()) {
+      cerr << "error: truncated BAM index [" << name << "]" << endl;
+      exit(1);
+    }
+    unsigned long long int res = get_le(&s[i], n);
+    i += n;
+    return res;
+  };
+  if (s.size() < 8 or s.compare(0, 4, "BAI\1") != 0) {
+    cerr << "error: not a BAM index [" << name << "]" << endl;
+    exit(1);
+  }
+  i = 4;
+  int n_ref = get(4);
+  ref_.resize(n_ref);
+  for (int r = 0; r < n_ref; ++r) {
+    int n_bin = get(4);
+    for (int b = 0; b < n_bin; ++b) {
+      unsigned bin = get(4);
+      int n_chunk = get(4);
+      vector<Chunk>& v = ref_[r].bin[bin];
+      for (int c = 0; c < n_chunk; ++c) {
+	VOffset beg = get(8);
+	VOffset end = get(8);
+	// the pseudo-bin holds statistics, not records
+	if (bin == pseudo_bin) continue;
+	v.push_back(Chunk(beg, end));
+	max_end_ = max(max_end_, end);
+      }
+      if (bin == pseudo_bin) ref_[r].bin.erase(bin);
+    }
+    int n_intv = get(4);
+    ref_[r].linear.resize(n_intv);
+    for (int k = 0; k < n_intv; ++k) ref_[r].linear[k] = get(8);
+  }
+  return true;
+}
+
+void
+BamIndex::query(int ref_id, long long int beg, long long int end, vector<Chunk>& res) const
+{
+  if (ref_id < 0 or ref_id >= n_refs() or end <= beg) return;
+  const Ref& ref = ref_[ref_id];
+  // records overlapping the interval start no earlier than this
+  VOffset min_off = 0;
+  if (ref.linear.size() > 0)
+    min_off = ref.linear[min<size_t>(beg >> 14, ref.linear.size() - 1)];
+  vector<unsigned> bins;
+  reg2bins(beg, end, bins);
+  for (size_t i = 0; i < bins.size(); ++i) {
+    unordered_map<unsigned, vector<Chunk> >::const_iterator it = ref.bin.find(bins[i]);
+    if (it == ref.bin.end()) continue;
+    for (size_t j = 0; j < it->second.size(); ++j)
+      if (it->second[j].end > min_off)
+	res.push_back(Chunk(max(it->second[j].beg, min_off), it->second[j].end));
+  }
+}
+
+void
+BamIndex::merge(vector<Chunk>& v)
+{
+  sort(v.begin(), v.end());
+  size_t k = 0;
+  for (size_t i = 0; i < v.size(); ++i) {
+    if (k > 0 and v[i].beg <= v[k - 1].end)
+      v[k - 1].end = max(v[k - 1].end, v[i].end);
+    else
+      v[k++] = v[i];
+  }
+  v.resize(k);
+}
+
+string
+find_bam_index(const string& name)
+{
+  string res = name + ".bai";
+  if (FILE * f = fopen(res.c_str(), "rb")) {
+    fclose(f);
+    return res;
+  }
+  if (name.size() > 4 and name.compare(name.size() - 4, 4, ".bam") == 0)
+    return name.substr(0, name.size() - 4) + ".bai";
+  return res;
+}
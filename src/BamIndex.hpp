@@ -0,0 +1,102 @@
+#ifndef BamIndex_hpp_
+#define BamIndex_hpp_
+
+using namespace std;
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <zlib.h>
+
+
+// position in a BGZF file: offset of the compressed block << 16 | offset in the block data
+typedef unsigned long long int VOffset;
+
+
+// random access reader of a BGZF file; reads go across block boundaries
+class BgzfReader
+{
+public:
+  BgzfReader();
+  ~BgzfReader();
+
+  // false if the file cannot be opened
+  bool open(const string &);
+  void seek(VOffset);
+  // position of the next byte; at the end of a block, this is the start of the next one
+  VOffset tell();
+  // read n bytes into s; false at the end of the file
+  bool read(size_t, string &);
+  bool eof();
+
+  long long int n_blocks() const { return n_blocks_; }
+
+private:
+  string name_;
+  FILE * f_;
+  long long int block_off_;
+  long long int next_block_off_;
+  string raw_;
+  string data_;
+  size_t pos_;
+  bool eof_;
+  z_stream zs_;
+  long long int n_blocks_;
+
+  // load the next block while the current one is used up; false at the end of the file
+  bool fill();
+  bool load_block(long long int);
+
+  BgzfReader(const BgzfReader &);
+  BgzfReader & operator =(const BgzfReader &);
+};
+
+
+// the BAI index of a coordinate-sorted BAM file: per reference, the bins of the
+// UCSC binning scheme, each with the file chunks holding its records, and the
+// linear index of the smallest offset of records overlapping each 16kbp window
+class BamIndex
+{
+public:
+  class Chunk
+  {
+  public:
+    VOffset beg;
+    VOffset end;
+
+    Chunk(VOffset _beg = 0, VOffset _end = 0) : beg(_beg), end(_end) {}
+    bool operator <(const Chunk & rhs) const { return beg < rhs.beg; }
+  };
+
+  BamIndex() : max_end_(0) {}
+
+  // false if the file cannot be opened; exits if it is malformed
+  bool load(const string &);
+  int n_refs() const { return ref_.size(); }
+  // append the chunks that may hold records of reference ref_id overlapping
+  // the 0-based interval [beg, end)
+  void query(int, long long int, long long int, vector<Chunk> &) const;
+  // offset past the last chunk of placed records, where the unplaced ones start
+  VOffset unplaced_offset() const { return max_end_; }
+
+  // sort chunks and merge the ones that overlap or touch
+  static void merge(vector<Chunk> &);
+
+private:
+  class Ref
+  {
+  public:
+    unordered_map<unsigned, vector<Chunk> > bin;
+    vector<VOffset> linear;
+  };
+
+  vector<Ref> ref_;
+  VOffset max_end_;
+};
+
+// the index of a BAM file: <file>.bai, or <file> with .bam replaced by .bai
+string find_bam_index(const string &);
+
+
+#endif
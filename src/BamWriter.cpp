@@ -0,0 +1,540 @@
+#include "BamWriter.hpp"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+
+BgzfCompressor::BgzfCompressor(int level)
+{
+  memset(&zs_, 0, sizeof(zs_));
+  if (deflateInit2(&zs_, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    cerr << "error: could not initialize deflate" << endl;
+    exit(1);
+  }
+}
+
+BgzfCompressor::~BgzfCompressor()
+{
+  deflateEnd(&zs_);
+}
+
+void
+BgzfCompressor::append_block(string & s, const char * p, size_t len)
+{
+  static const unsigned char header[] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0
+  };
+  const size_t header_len = sizeof(header) + 2;
+
+  // stored blocks add 5 bytes per 64KB; compressed ones may in the worst case grow a bit more
+  size_t start = s.size();
+  s.resize(start + header_len + deflateBound(&zs_, len) + 8);
+  char * block = &s[start];
+  deflateReset(&zs_);
+  zs_.next_in = (Bytef *)p;
+  zs_.avail_in = len;
+  zs_.next_out = (Bytef *)block + header_len;
+  zs_.avail_out = s.size() - start - header_len - 8;
+  if (deflate(&zs_, Z_FINISH) != Z_STREAM_END) {
+    cerr << "error: deflate failed" << endl;
+    exit(1);
+  }
+  size_t c_len = s.size() - start - header_len - 8 - zs_.avail_out;
+  size_t b_len = header_len + c_len + 8;
+  if (b_len > 0x10000) {
+    cerr << "error: BGZF block too large" << endl;
+    exit(1);
+  }
+
+  memcpy(block, header, sizeof(header));
+  block[16] = char((b_len - 1) & 0xff);
+  block[17] = char((b_len - 1) >> 8);
+  unsigned long crc = crc32(crc32(0, NULL, 0), (const Bytef *)p, len);
+  char * q = block + header_len + c_len;
+  for (int i = 0; i < 4; ++i) q[i] = char((crc >> (8 * i)) & 0xff);
+  for (int i = 0; i < 4; ++i) q[4 + i] = char((len >> (8 * i)) & 0xff);
+  s.resize(start + b_len);
+}
+
+void
+BgzfCompressor::append(string & s, const char * p, size_t len)
+{
+  while (len > 0) {
+    size_t n = min(len, max_block_data);
+    append_block(s, p, n);
+    p += n;
+    len -= n;
+  }
+}
+
+
+BgzfWriter::BgzfWriter(FILE * f, int level)
+  : f_(f),
+    writer_(NULL),
+    fd_(-1),
+    closed_(false),
+    compressor_(level)
+{
+  data_.reserve(max_block_data);
+}
+
+BgzfWriter::BgzfWriter(OutputWriter * writer, int fd, int level)
+  : f_(NULL),
+    writer_(writer),
+    fd_(fd),
+    closed_(false),
+    compressor_(level)
+{
+  data_.reserve(max_block_data);
+}
+
+BgzfWriter::~BgzfWriter() {}
+
+void
+BgzfWriter::write(const char * p, size_t len)
+{
+  while (len > 0) {
+    size_t n = min(len, max_block_data - data_.size());
+    data_.append(p, n);
+    p += n;
+    len -= n;
+    if (data_.size() == max_block_data) {
+      write_block(data_.data(), data_.size());
+      data_.clear();
+    }
+  }
+}
+
+void
+BgzfWriter::flush()
+{
+  if (data_.size() > 0) {
+    write_block(data_.data(), data_.size());
+    data_.clear();
+  }
+  if (writer_ != NULL)
+    writer_->write(fd_, out_);
+  else
+    fflush(f_);
+}
+
+void
+BgzfWriter::close()
+{
+  if (closed_) return;
+  if (data_.size() > 0) {
+    write_block(data_.data(), data_.size());
+    data_.clear();
+  }
+  write_block(NULL, 0);
+  flush();
+  closed_ = true;
+}
+
+void
+BgzfWriter::write_block(const char * p, size_t len)
+{
+  if (writer_ != NULL) {
+    compressor_.append_block(out_, p, len);
+    if (out_.size() >= writer_batch)
+      writer_->write(fd_, out_);
+  } else {
+    block_.clear();
+    compressor_.append_block(block_, p, len);
+    if (fwrite(block_.data(), 1, block_.size(), f_) != block_.size()) {
+      cerr << "error writing BGZF block" << endl;
+      exit(1);
+    }
+  }
+}
+
+namespace {
+  inline void
+  put_le16(string & s, unsigned v)
+  {
+    s += char(v & 0xff);
+    s += char((v >> 8) & 0xff);
+  }
+
+  inline void
+  put_le32(string & s, unsigned v)
+  {
+    s += char(v & 0xff);
+    s += char((v >> 8) & 0xff);
+    s += char((v >> 16) & 0xff);
+    s += char((v >> 24) & 0xff);
+  }
+
+  inline void
+  set_le32(string & s, size_t pos, unsigned v)
+  {
+    for (int i = 0; i < 4; ++i) s[pos + i] = char((v >> (8 * i)) & 0xff);
+  }
+
+  inline void
+  set_le16(char *& w, unsigned v)
+  {
+    *w++ = char(v & 0xff);
+    *w++ = char((v >> 8) & 0xff);
+  }
+
+  inline void
+  set_le32(char *& w, unsigned v)
+  {
+    *w++ = char(v & 0xff);
+    *w++ = char((v >> 8) & 0xff);
+    *w++ = char((v >> 16) & 0xff);
+    *w++ = char((v >> 24) & 0xff);
+  }
+
+  // parse a decimal integer spanning the whole view
+  bool
+  parse_int(const StrView & v, long long int & res)
+  {
+    size_t i = (v.size() > 0 and (v[0] == '-' or v[0] == '+')? 1 : 0);
+    if (i == v.size()) return false;
+    unsigned long long int u = 0;
+    for (; i < v.size(); ++i) {
+      if (v[i] < '0' or v[i] > '9') return false;
+      u = 10 * u + (v[i] - '0');
+    }
+    res = (v[0] == '-'? -(long long int)u : (long long int)u);
+    return true;
+  }
+
+  // bin of the smallest index interval containing [beg, end), as in the SAM spec
+  int
+  reg2bin(int beg, int end)
+  {
+    --end;
+    if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+    if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+    if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+    if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+    if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+    return 0;
+  }
+
+  int
+  cigar_op_code(char c)
+  {
+    switch (c) {
+    case 'M': return 0;
+    case 'I': return 1;
+    case 'D': return 2;
+    case 'N': return 3;
+    case 'S': return 4;
+    case 'H': return 5;
+    case 'P': return 6;
+    case '=': return 7;
+    case 'X': return 8;
+    default: return -1;
+    }
+  }
+
+  class SeqCodeTable
+  {
+  public:
+    unsigned char code[256];
+    SeqCodeTable() {
+      static const char seq_codes[] = "=ACMGRSVTWYHKDBN";
+      memset(code, 15, sizeof(code));
+      for (int i = 0; i < 16; ++i) {
+	code[(unsigned char)seq_codes[i]] = i;
+	code[(unsigned char)tolower(seq_codes[i])] = i;
+      }
+    }
+  };
+  const SeqCodeTable seq_code_table;
+
+  void
+  bad_record(const SamMapping & m, const char * what)
+  {
+    cerr << "error: cannot encode " << what << " in BAM: " << m.line() << endl;
+    exit(1);
+  }
+
+  void
+  put_bam_int(string & s, long long int v)
+  {
+    if (v < 0) {
+      if (v >= -128) { s += 'c'; s += char(v); }
+      else if (v >= -32768) { s += 's'; put_le16(s, unsigned(v)); }
+      else { s += 'i'; put_le32(s, unsigned(v)); }
+    } else {
+      if (v <= 255) { s += 'C'; s += char(v); }
+      else if (v <= 65535) { s += 'S'; put_le16(s, unsigned(v)); }
+      else { s += 'I'; put_le32(s, unsigned(v)); }
+    }
+  }
+
+  void
+  put_bam_float(string & s, float f)
+  {
+    unsigned v;
+    memcpy(&v, &f, 4);
+    put_le32(s, v);
+  }
+
+  // append the value of one optional field, given as SAM text
+  bool
+  put_bam_tag_value(string & s, char t, const StrView & val)
+  {
+    string tmp;
+    switch (t) {
+    case 'A':
+      if (val.size() != 1) return false;
+      s += 'A';
+      s += val[0];
+      return true;
+    case 'i':
+      {
+	long long int v;
+	if (not parse_int(val, v)) return false;
+	put_bam_int(s, v);
+	return true;
+      }
+    case 'f':
+      val.assign_to(tmp);
+      s += 'f';
+      put_bam_float(s, strtof(tmp.c_str(), NULL));
+      return true;
+    case 'Z': case 'H':
+      s += t;
+      s.append(val.data(), val.size());
+      s += '\0';
+      return true;
+    case 'B':
+      {
+	if (val.size() == 0) return false;
+	char sub_t = val[0];
+	s += 'B';
+	s += sub_t;
+	size_t n_pos = s.size();
+	put_le32(s, 0);
+	unsigned n = 0;
+	size_t i = 1;
+	while (i < val.size()) {
+	  if (val[i] != ',') return false;
+	  size_t j = val.find(',', i + 1);
+	  if (j == StrView::npos) j = val.size();
+	  val.substr(i + 1, j - i - 1).assign_to(tmp);
+	  long long int v = atoll(tmp.c_str());
+	  switch (sub_t) {
+	  case 'c': case 'C': s += char(v); break;
+	  case 's': case 'S': put_le16(s, unsigned(v)); break;
+	  case 'i': case 'I': put_le32(s, unsigned(v)); break;
+	  case 'f': put_bam_float(s, strtof(tmp.c_str(), NULL)); break;
+	  default: return false;
+	  }
+	  ++n;
+	  i = j;
+	}
+	set_le32(s, n_pos, n);
+	return true;
+      }
+    default:
+      return false;
+    }
+  }
+
+  // copy a decoded BAM record (without the block_size prefix) with new flags: the low
+  // 16 bits go in the FLAG field, the rest in an extra flags tag placed first, as
+  // load_bam() expects; rec was validated when it was loaded
+  void
+  append_bam_record_with_flags(string & s, const StrView & rec, unsigned long flags)
+  {
+    const unsigned char * p = (const unsigned char *)rec.data();
+    size_t n_cigar_op = p[12] | (p[13] << 8);
+    size_t l_seq = p[16] | (p[17] << 8) | (p[18] << 16) | ((size_t)p[19] << 24);
+    size_t tags_start = 32 + p[8] + 4 * n_cigar_op + (l_seq + 1) / 2 + l_seq;
+    size_t tags_rest = tags_start;
+    if (rec.size() >= tags_start + 7 and rec[tags_start] == 'x' and rec[tags_start + 1] == 'f'
+	and rec[tags_start + 2] == 'I')
+      tags_rest += 7;
+    bool need_extra_flags = (flags >> 16) != 0;
+
+    put_le32(s, tags_start + (need_extra_flags? 7 : 0) + (rec.size() - tags_rest));
+    size_t flag_pos = s.size() + 14;
+    s.append(rec.data(), tags_start);
+    s[flag_pos] = char(flags & 0xff);
+    s[flag_pos + 1] = char((flags >> 8) & 0xff);
+    if (need_extra_flags) {
+      s += 'x';
+      s += 'f';
+      s += 'I';
+      put_le32(s, unsigned(flags >> 16));
+    }
+    s.append(rec.data() + tags_rest, rec.size() - tags_rest);
+  }
+
+  // references in the header written by append_bam_header(); -1 before that
+  int n_header_refs = -1;
+
+  // BAM reference id of a contig: its index in the header; contigs that entered the
+  // dictionary after the header was written have none
+  int
+  header_ref_id(const SamMapping & m, const Contig * contig)
+  {
+    if (contig == NULL) return -1;
+    if (n_header_refs >= 0 and contig->idx >= n_header_refs) {
+      cerr << "error: contig [" << contig->name << "] is missing from the BAM header; "
+	   << "BAM output needs @SQ lines for all contigs before the first record: "
+	   << m.line() << endl;
+      exit(1);
+    }
+    return contig->idx;
+  }
+
+  // reference ids of a copied record are those of the input header; put in the output ones
+  void
+  set_ref_ids(string & s, size_t start, const SamMapping & m)
+  {
+    set_le32(s, start + 4, unsigned(header_ref_id(m, m.db)));
+    set_le32(s, start + 4 + 20, unsigned(header_ref_id(m, m.mp_db)));
+  }
+}
+
+
+void
+append_bam_header(string & s, const string & text, const SQDict & dict)
+{
+  vector<const Contig *> refs(dict.size(), NULL);
+  for (SQDict::const_iterator it = dict.begin(); it != dict.end(); ++it) {
+    if (it->second.idx < 0 or it->second.idx >= (int)refs.size() or refs[it->second.idx] != NULL) {
+      cerr << "error: contig indexes are not dense; cannot build BAM reference list" << endl;
+      exit(1);
+    }
+    refs[it->second.idx] = &it->second;
+  }
+
+  s.append("BAM\1", 4);
+  put_le32(s, text.size());
+  s += text;
+  put_le32(s, refs.size());
+  for (size_t i = 0; i < refs.size(); ++i) {
+    put_le32(s, refs[i]->name.size() + 1);
+    s += refs[i]->name;
+    s += '\0';
+    put_le32(s, unsigned(refs[i]->len));
+  }
+  n_header_refs = refs.size();
+}
+
+void
+append_bam_record(string & s, const SamMapping & m)
+{
+  size_t start = s.size();
+
+  // records read from BAM and not modified since are copied as they are
+  StrView rec = m.bam_record();
+  if (rec.size() > 0 and m.flags.to_ulong() == m.bam_flags()) {
+    put_le32(s, rec.size());
+    s.append(rec.data(), rec.size());
+    set_ref_ids(s, start, m);
+    return;
+  }
+  // records that only had their flags changed are copied with the FLAG field patched,
+  // and the extra flags tag replaced
+  if (rec.size() > 0) {
+    append_bam_record_with_flags(s, rec, m.flags.to_ulong());
+    set_ref_ids(s, start, m);
+    return;
+  }
+
+  put_le32(s, 0); // block_size, set at the end
+
+  StrView name = m.name();
+  if (name.size() > 254) bad_record(m, "read name");
+  StrView cigar = m.cigar();
+  StrView seq = m.seq();
+  StrView qv = m.qvString();
+  int l_seq = (seq == "*"? 0 : seq.size());
+  if (l_seq > 0 and qv != "*" and (int)qv.size() != l_seq) bad_record(m, "quality string");
+  unsigned long flags = m.flags.to_ulong();
+
+  // cigar ops, and the reference span needed for the bin
+  static thread_local vector<unsigned> ops;
+  ops.clear();
+  long long int ref_len = 0;
+  if (cigar != "*") {
+    unsigned len = 0;
+    bool have_len = false;
+    for (size_t i = 0; i < cigar.size(); ++i) {
+      char c = cigar[i];
+      if (c >= '0' and c <= '9') {
+	len = 10 * len + (c - '0');
+	have_len = true;
+      } else {
+	int op = cigar_op_code(c);
+	if (op < 0 or not have_len) bad_record(m, "cigar");
+	ops.push_back((len << 4) | op);
+	if (op == 0 or op == 2 or op == 3 or op == 7 or op == 8) ref_len += len;
+	len = 0;
+	have_len = false;
+      }
+    }
+    if (have_len or ops.size() > 0xffff) bad_record(m, "cigar");
+  }
+
+  int ref_id = header_ref_id(m, m.db);
+  int pos = int(m.dbPos - 1);
+  int end = (ref_len > 0? int(pos + ref_len) : pos + 1);
+
+  // fixed-size fields, name, cigar, sequence and qualities are written through a cursor
+  s.resize(start + 36 + name.size() + 1 + 4 * ops.size() + (l_seq + 1) / 2 + l_seq);
+  char * w = &s[start + 4];
+  set_le32(w, ref_id);
+  set_le32(w, pos);
+  *w++ = char(name.size() + 1);
+  *w++ = char(m.mqv);
+  set_le16(w, reg2bin(pos, end));
+  set_le16(w, ops.size());
+  set_le16(w, flags & 0xffff);
+  set_le32(w, l_seq);
+  set_le32(w, header_ref_id(m, m.mp_db));
+  set_le32(w, unsigned(m.mp_dbPos - 1));
+  set_le32(w, unsigned(m.tLen));
+  memcpy(w, name.data(), name.size());
+  w += name.size();
+  *w++ = '\0';
+  for (size_t i = 0; i < ops.size(); ++i) set_le32(w, ops[i]);
+  const unsigned char * sq = (const unsigned char *)seq.data();
+  for (int i = 0; i + 1 < l_seq; i += 2) {
+    *w++ = char((seq_code_table.code[sq[i]] << 4) | seq_code_table.code[sq[i + 1]]);
+  }
+  if (l_seq % 2 == 1) *w++ = char(seq_code_table.code[sq[l_seq - 1]] << 4);
+  if (l_seq > 0 and qv == "*") {
+    memset(w, 0xff, l_seq);
+  } else {
+    const char * q = qv.data();
+    for (int i = 0; i < l_seq; ++i) w[i] = char(q[i] - 33);
+  }
+
+  // optional fields, in input order; flags that do not fit in 16 bits go first
+  if (flags >> 16) {
+    s += 'x';
+    s += 'f';
+    s += 'I';
+    put_le32(s, unsigned(flags >> 16));
+  }
+  StrView tags = m.tags();
+  size_t i = 0;
+  while (i < tags.size()) {
+    size_t j = tags.find('\t', i);
+    if (j == StrView::npos) j = tags.size();
+    if (j - i < 5) bad_record(m, "optional field");
+    if (SAM_TAG(tags[i], tags[i + 1]) != SamMapping::bam_extra_flags_tag) {
+      s += tags[i];
+      s += tags[i + 1];
+      if (not put_bam_tag_value(s, tags[i + 3], tags.substr(i + 5, j - i - 5)))
+	bad_record(m, "optional field");
+    }
+    i = j + 1;
+  }
+
+  set_le32(s, start, s.size() - start - 4);
+}
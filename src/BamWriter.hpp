@@ -0,0 +1,86 @@
+#ifndef BamWriter_hpp_
+#define BamWriter_hpp_
+
+using namespace std;
+
+#include <cstdio>
+#include <string>
+#include <zlib.h>
+
+#include "DNASequence.hpp"
+#include "SamMapping.hpp"
+#include "OutputWriter.hpp"
+
+
+// compresses data into BGZF: a series of gzip members of at most 64KB each, with the
+// block size stored in a BC extra field; level 0 produces uncompressed blocks;
+// each thread compressing at the same time needs its own compressor
+class BgzfCompressor
+{
+public:
+  static const size_t max_block_data = 0xff00;
+
+  BgzfCompressor(int = 0);
+  ~BgzfCompressor();
+
+  // append the block holding the given data, of at most max_block_data bytes;
+  // no data gives the empty end-of-file block
+  void append_block(string &, const char *, size_t);
+  // append as many full blocks as the data needs
+  void append(string &, const char *, size_t);
+
+private:
+  z_stream zs_;
+
+  BgzfCompressor(const BgzfCompressor &);
+  BgzfCompressor & operator =(const BgzfCompressor &);
+};
+
+
+// writes BGZF to a FILE, or to a file descriptor through an OutputWriter,
+// in which case blocks are handed over in batches
+class BgzfWriter
+{
+public:
+  static const size_t max_block_data = BgzfCompressor::max_block_data;
+  static const size_t writer_batch = 1u << 20;
+
+  BgzfWriter(FILE *, int = 0);
+  BgzfWriter(OutputWriter *, int, int = 0);
+  ~BgzfWriter();
+
+  void write(const char *, size_t);
+  void write(const string & s) { write(s.data(), s.size()); }
+  // write out the pending data
+  void flush();
+  // flush and write the empty end-of-file block
+  void close();
+
+private:
+  FILE * f_;
+  OutputWriter * writer_;
+  int fd_;
+  // blocks not yet handed to the writer
+  string out_;
+  bool closed_;
+  string data_;
+  string block_;
+  BgzfCompressor compressor_;
+
+  void write_block(const char *, size_t);
+
+  BgzfWriter(const BgzfWriter &);
+  BgzfWriter & operator =(const BgzfWriter &);
+};
+
+
+// append the BAM magic, header text and reference list built from the dictionary,
+// in contig index order; contig idx is used as the BAM reference id
+void append_bam_header(string &, const string &, const SQDict &);
+// append one record in BAM encoding (including the block_size prefix);
+// records decoded from BAM whose flags did not change are copied verbatim, but for
+// their reference ids; exits if a contig is not in the header written before
+void append_bam_record(string &, const SamMapping &);
+
+
+#endif
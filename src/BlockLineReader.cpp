@@ -0,0 +1,231 @@
+#include "BlockLineReader.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+
+LineBlockFreeList::~LineBlockFreeList()
+{
+  for (size_t i = 0; i < free_.size(); ++i) delete free_[i];
+}
+
+LineBlock *
+LineBlockFreeList::get()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (free_.size() > 0) {
+      LineBlock * res = free_.back();
+      free_.pop_back();
+      return res;
+    }
+  }
+  return new LineBlock(block_size_);
+}
+
+void
+LineBlockFreeList::put(LineBlock * b)
+{
+  if (b->size() <= max_kept_growth * block_size_) {
+    lock_guard<mutex> lock(mutex_);
+    if (free_.size() < max_kept) {
+      free_.push_back(b);
+      return;
+    }
+  }
+  delete b;
+}
+
+
+BlockLineReader::BlockLineReader(istream * istr, size_t block_size)
+  : istr_(istr),
+    block_size_(block_size),
+    free_list_(new LineBlockFreeList(block_size)),
+    pos_(0),
+    end_(0),
+    eof_(false),
+    bad_(false),
+    n_lines_(0),
+    n_bytes_(0),
+    start_(chrono::steady_clock::now()),
+    input_type_(unknown_input),
+    raw_eof_(false)
+{
+  memset(&zs_, 0, sizeof(zs_));
+}
+
+BlockLineReader::~BlockLineReader()
+{
+  if (input_type_ == gzip_input)
+    inflateEnd(&zs_);
+}
+
+void
+BlockLineReader::fill(size_t need)
+{
+  // the block goes back to the free list when the last line referring to it is dropped
+  shared_ptr<LineBlockFreeList> free_list = free_list_;
+  LineBlockPtr next(free_list->get(), [free_list] (LineBlock * b) { free_list->put(b); });
+
+  // carry over the incomplete line at the end of the current block;
+  // grow the block if a single line or record does not fit
+  size_t tail = end_ - pos_;
+  if (next->size() < max(tail + block_size_ / 2, need)) {
+    next->resize(max(2 * tail + block_size_, need));
+  }
+  if (tail > 0) {
+    memcpy(&(*next)[0], &(*crt_)[pos_], tail);
+  }
+  crt_ = next;
+  pos_ = 0;
+  end_ = tail;
+
+  size_t n = read_input(&(*crt_)[end_], crt_->size() - end_);
+  end_ += n;
+  n_bytes_ += n;
+}
+
+// read up to n bytes of (decompressed) input; sets eof_ and bad_
+size_t
+BlockLineReader::read_input(char * dest, size_t n)
+{
+  if (input_type_ == unknown_input) {
+    if (istr_->peek() == 0x1f) {
+      // gzip magic; zlib handles the member headers, including BGZF extra fields
+      if (inflateInit2(&zs_, 15 + 16) != Z_OK) {
+	cerr << "error: could not initialize inflate" << endl;
+	exit(1);
+      }
+      raw_.resize(block_size_ / 4);
+      input_type_ = gzip_input;
+    } else {
+      istr_->clear();
+      input_type_ = plain_input;
+    }
+  }
+  if (input_type_ == gzip_input) {
+    return inflate_input(dest, n);
+  }
+
+  istr_->read(dest, n);
+  size_t res = istr_->gcount();
+  if (istr_->bad()) {
+    bad_ = true;
+    eof_ = true;
+  } else if (not *istr_) {
+    eof_ = true;
+  }
+  return res;
+}
+
+size_t
+BlockLineReader::inflate_input(char * dest, size_t n)
+{
+  zs_.next_out = (Bytef *)dest;
+  zs_.avail_out = n;
+  while (zs_.avail_out > 0) {
+    if (zs_.avail_in == 0) {
+      if (raw_eof_) {
+	if (zs_.total_in > 0) {
+	  cerr << "error: truncated gzip input" << endl;
+	  bad_ = true;
+	}
+	eof_ = true;
+	break;
+      }
+      istr_->read(&raw_[0], raw_.size());
+      zs_.next_in = (Bytef *)&raw_[0];
+      zs_.avail_in = istr_->gcount();
+      if (istr_->bad()) {
+	bad_ = true;
+	eof_ = true;
+	break;
+      } else if (not *istr_) {
+	raw_eof_ = true;
+      }
+      continue;
+    }
+    int ret = inflate(&zs_, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      // next gzip member, if any
+      inflateReset(&zs_);
+    } else if (ret != Z_OK and ret != Z_BUF_ERROR) {
+      cerr << "error: corrupt gzip input" << (zs_.msg != NULL? string(": ") + zs_.msg : string()) << endl;
+      bad_ = true;
+      eof_ = true;
+      break;
+    }
+  }
+  return n - zs_.avail_out;
+}
+
+bool
+BlockLineReader::get_line(StrView & line)
+{
+  while (true) {
+    if (pos_ < end_) {
+      const char * p = &(*crt_)[0];
+      const char * q = (const char *)memchr(p + pos_, '\n', end_ - pos_);
+      if (q != NULL) {
+	line = StrView(p + pos_, q - (p + pos_));
+	pos_ = q - p + 1;
+	++n_lines_;
+	return true;
+      }
+      if (eof_) {
+	// last line without newline
+	line = StrView(p + pos_, end_ - pos_);
+	pos_ = end_;
+	++n_lines_;
+	return true;
+      }
+    } else if (eof_) {
+      return false;
+    }
+    fill();
+  }
+}
+
+bool
+BlockLineReader::ensure(size_t n)
+{
+  while (end_ - pos_ < n and not eof_) {
+    fill(n);
+  }
+  return end_ - pos_ >= n;
+}
+
+bool
+BlockLineReader::get_bytes(size_t n, StrView & bytes)
+{
+  if (not ensure(n)) return false;
+  bytes = StrView(&(*crt_)[pos_], n);
+  pos_ += n;
+  return true;
+}
+
+bool
+BlockLineReader::peek_bytes(size_t n, StrView & bytes)
+{
+  if (not ensure(n)) return false;
+  bytes = StrView(&(*crt_)[pos_], n);
+  return true;
+}
+
+double
+BlockLineReader::seconds() const
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start_).count();
+}
+
+
+void
+print_read_stats(ostream & os, const char * what, long long int n_records, long long int n_bytes,
+		 double seconds)
+{
+  if (seconds <= 0) seconds = 1e-9;
+  os << "read " << n_records << " " << what << " (" << n_bytes << " bytes) in " << seconds << "s: "
+     << n_records / seconds << " records/s, "
+     << double(n_bytes) / (1 << 20) / seconds << " MB/s\n";
+}
@@ -0,0 +1,102 @@
+#ifndef BlockLineReader_hpp_
+#define BlockLineReader_hpp_
+
+using namespace std;
+
+#include <chrono>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include <zlib.h>
+
+#include "StrView.hpp"
+
+
+typedef vector<char> LineBlock;
+typedef shared_ptr<LineBlock> LineBlockPtr;
+
+
+// blocks whose last pointer was dropped, kept for the reader to reuse; shared by the
+// reader and its blocks, since those may outlive it
+class LineBlockFreeList
+{
+public:
+  // at most this many blocks are kept; blocks grown past max_kept_growth times the block
+  // size for a long line are freed
+  static const size_t max_kept = 16;
+  static const size_t max_kept_growth = 4;
+
+  LineBlockFreeList(size_t block_size) : block_size_(block_size) {}
+  ~LineBlockFreeList();
+
+  // a free block, or a new one
+  LineBlock * get();
+  void put(LineBlock *);
+
+private:
+  size_t block_size_;
+  mutex mutex_;
+  vector<LineBlock *> free_;
+
+  LineBlockFreeList(const LineBlockFreeList &);
+  LineBlockFreeList & operator =(const LineBlockFreeList &);
+};
+
+
+// reads an istream in large blocks and splits it into lines or
+// fixed-size binary records; a line or record is a view into the block
+// returned by block(), which stays alive for as long as someone holds
+// a pointer to it, and then goes back to the free list; gzip input (including BGZF, which is a series of gzip
+// members) is inflated straight into the blocks
+class BlockLineReader
+{
+public:
+  static const size_t default_block_size = 4u << 20;
+
+  BlockLineReader(istream *, size_t = default_block_size);
+  ~BlockLineReader();
+
+  // get next line, without the trailing newline; false at the end of input
+  bool get_line(StrView &);
+  // get the next n bytes; false if the input ends first
+  bool get_bytes(size_t, StrView &);
+  // look at the next n bytes without consuming them
+  bool peek_bytes(size_t, StrView &);
+  const LineBlockPtr & block() const { return crt_; }
+  bool bad() const { return bad_; }
+  bool done() const { return eof_ and pos_ >= end_; }
+
+  long long int n_lines() const { return n_lines_; }
+  long long int n_bytes() const { return n_bytes_; }
+  double seconds() const;
+
+private:
+  istream * istr_;
+  size_t block_size_;
+  shared_ptr<LineBlockFreeList> free_list_;
+  LineBlockPtr crt_;
+  size_t pos_;
+  size_t end_;
+  bool eof_;
+  bool bad_;
+  long long int n_lines_;
+  long long int n_bytes_;
+  chrono::steady_clock::time_point start_;
+  // compressed input state
+  enum { unknown_input, plain_input, gzip_input } input_type_;
+  z_stream zs_;
+  vector<char> raw_;
+  bool raw_eof_;
+
+  void fill(size_t = 0);
+  size_t read_input(char *, size_t);
+  size_t inflate_input(char *, size_t);
+  bool ensure(size_t);
+};
+
+void print_read_stats(ostream &, const char *, long long int, long long int, double);
+
+
+#endif
@@ -6,18 +6,22 @@
 
 
 vector<pair<char,int> >
-getCigarOps(const string& cigar)
+getCigarOps(const StrView& cigar)
 {
   vector<pair<char,int> > result;
-  char* s = (char *)cigar.c_str();
-  char* c;
-  int l;
-  while (true) {
-    l = strtol(s, &c, 10);
-    if (c == s)
+  size_t i = 0;
+  while (i < cigar.size()) {
+    if (cigar[i] < '0' or cigar[i] > '9')
       break;
-    result.push_back(pair<char,int>(*c, l));
-    s = c + 1;
+    int l = 0;
+    while (i < cigar.size() and cigar[i] >= '0' and cigar[i] <= '9') {
+      l = 10 * l + (cigar[i] - '0');
+      ++i;
+    }
+    if (i == cigar.size())
+      break;
+    result.push_back(pair<char,int>(cigar[i], l));
+    ++i;
   }
 
   //cerr << "getCigarOps: cigar=" << cigar << " =>";
@@ -31,7 +35,7 @@ getCigarOps(const string& cigar)
 
 
 void
-parseCigar(const string& cigar, long long int dbPos_start,
+parseCigar(const StrView& cigar, long long int dbPos_start,
 	   Interval<int>& qrPos, Interval<long long int>& dbPos)
 {
   vector<pair<char,int> > cigar_ops = getCigarOps(cigar);
@@ -156,7 +160,7 @@ get_tail_insert_size_aux(const vector<pair<char,int> >& cigar_ops, int min_tail_
 
 
 void
-get_tail_insert_size(const string& cigar, int min_tail_match_len, vector<int>& tails)
+get_tail_insert_size(const StrView& cigar, int min_tail_match_len, vector<int>& tails)
 {
   vector<pair<char,int> > cigar_ops = getCigarOps(cigar);
 
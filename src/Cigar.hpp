@@ -8,10 +8,11 @@ using namespace std;
 #include <vector>
 
 #include "Interval.hpp"
+#include "StrView.hpp"
 
 
-void parseCigar(const string&, long long, Interval<int>&, Interval<long long>&);
-void get_tail_insert_size(const string&, int, vector<int>&);
+void parseCigar(const StrView&, long long, Interval<int>&, Interval<long long>&);
+void get_tail_insert_size(const StrView&, int, vector<int>&);
 
 
 #endif
@@ -32,11 +32,13 @@ public:
   Interval<long long int> fragPos;
   vector<BP> bp;
   RepeatEvidence mappedToRepeatSt;
+  // number of identical pairs this one stands for
+  int multiplicity;
 
   bool use;
 
   Clone(const string & _name = string())
-    : name(_name), ref(NULL), pairing(NULL) {
+    : name(_name), ref(NULL), pairing(NULL), multiplicity(1) {
     read[0].st = 0;
     read[1].st = 0;
     read[0].nip = 0;
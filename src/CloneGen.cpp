@@ -14,7 +14,7 @@ convert_SamMapping_to_Mapping(const SamMapping& samMapping)
   result.db = samMapping.db;
   result.st = samMapping.st;
   result.mqv = samMapping.mqv;
-  parseCigar(samMapping.cigar, samMapping.dbPos, result.qrPos, result.dbPos);
+  parseCigar(samMapping.cigar(), samMapping.dbPos, result.qrPos, result.dbPos);
 
   //cerr << "parsing cigar=" << samMapping.cigar << ", start_dbPos=" << samMapping.dbPos
   //     << " => qrPos=" << result.qrPos << ", dbPos=" << result.dbPos << endl;
@@ -26,7 +26,7 @@ convert_SamMapping_to_Mapping(const SamMapping& samMapping)
 Clone*
 CloneGen::get_next()
 {
-  pair<string,vector<SamMapping> >* next_ref = refGen_.get_next();
+  SamMappingSet* next_ref = refGen_.get_next();
   if (next_rep_ == NULL) {
     next_rep_ = repGen_.get_next();
   }
@@ -45,14 +45,14 @@ CloneGen::get_next()
   result->name = next_ref->first;
   for_each(next_ref->second.begin(), next_ref->second.end(), [&] (const SamMapping & sm) {
       int nip;
-      fullNameParser_(sm.name, *result, nip);
+      fullNameParser_(sm.name().str(), *result, nip);
       if (result->read[nip].seq.length() == 0) {
 	if (not sm.mapped or sm.st == 0) {
-	  result->read[nip].seq = sm.seq;
-	  result->read[nip].qvString = sm.qvString;
+	  result->read[nip].seq = sm.seq().str();
+	  result->read[nip].qvString = sm.qvString().str();
 	} else {
-	  result->read[nip].seq = reverseComplement(sm.seq);
-	  result->read[nip].qvString = reverse(sm.qvString);
+	  result->read[nip].seq = reverseComplement(sm.seq().str());
+	  result->read[nip].qvString = reverse(sm.qvString().str());
 	}
       }
       if (sm.mapped) {
@@ -93,7 +93,7 @@ CloneGen::get_next()
 	     [&] (const SamMapping & sm) {
 	       if (sm.mapped) {
 		 int nip;
-		 fullNameParser_(sm.name, *result, nip);
+		 fullNameParser_(sm.name().str(), *result, nip);
 		 result->read[nip].mappedToRepeatSt[sm.st] = true;
 	       }
 	     });
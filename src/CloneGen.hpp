@@ -17,10 +17,10 @@ public:
   SamMappingSetGen repGen_;
   void (*fullNameParser_)(const string&, Clone&, int&);
 
-  pair<string,vector<SamMapping> >* next_rep_;
+  SamMappingSet* next_rep_;
 
   CloneGen(istream* ref_istr, istream* rep_istr,
-	   string (*cloneNameParser)(const string&),
+	   StrView (*cloneNameParser)(const StrView&),
 	   void (*fullNameParser)(const string&, Clone&, int&),
 	   void (*ref_headerLineHook)(const string&),
 	   void (*rep_headerLineHook)(const string&),
@@ -0,0 +1,121 @@
+#include "ContigIndex.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+
+#include "globals.hpp"
+
+
+size_t
+ContigIndex::hash(const StrView& s)
+{
+  // FNV-1a
+  size_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < s.size(); ++i) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+namespace {
+  mutex dict_mutex;
+}
+
+Contig *
+ContigIndex::find_slow(const StrView& name, const StrView& s, long long int len)
+{
+  size_t h = hash(name);
+  size_t mask = slot_.size() - 1;
+  for (size_t i = h & mask; slot_[i].contig != NULL; i = (i + 1) & mask) {
+    if (slot_[i].hash == h and name == StrView(slot_[i].contig->name))
+      return slot_[i].contig;
+  }
+  Contig * res;
+  {
+    lock_guard<mutex> lock(dict_mutex);
+    res = get_contig(name, dict_, add_to_dict_, s);
+    if (res->len == 0)
+      res->len = len;
+  }
+  insert(h, res);
+  return res;
+}
+
+void
+ContigIndex::insert(size_t h, Contig * contig)
+{
+  // keep the load factor under 1/2
+  if (2 * (n_ + 1) > slot_.size()) {
+    vector<Slot> old(2 * slot_.size());
+    old.swap(slot_);
+    n_ = 0;
+    for (size_t i = 0; i < old.size(); ++i)
+      if (old[i].contig != NULL) insert(old[i].hash, old[i].contig);
+  }
+  size_t mask = slot_.size() - 1;
+  size_t i = h & mask;
+  while (slot_[i].contig != NULL) i = (i + 1) & mask;
+  slot_[i].hash = h;
+  slot_[i].contig = contig;
+  ++n_;
+}
+
+
+Contig *
+get_contig(const StrView& contig_name, SQDict* dict, bool add_to_dict, const StrView& s)
+{
+  string tmp = contig_name.str();
+  Contig * res = &(*dict)[tmp];
+  if (res->name.length() == 0) {
+    if (add_to_dict) {
+      if (global::verbosity > 0)
+	clog << "adding contig [" << tmp << "]\n";
+      res->name = tmp;
+      res->idx = dict->size() - 1;
+    } else {
+      cerr << "error: missing sequence for contig [" << tmp
+	   << "] referred to in mapping [" << s << "]" << endl;
+      exit(1);
+    }
+  }
+  return res;
+}
+
+void
+add_sq_line_to_dict(const StrView& line, SQDict& dict)
+{
+  size_t i = line.find('\t');
+  if (line.substr(0, i) != "@SQ") return;
+
+  StrView contig_name;
+  long long int contig_len = 0;
+  while (contig_name.size() == 0 || contig_len == 0) {
+    if (i == StrView::npos) {
+      cerr << "did not find contig name and len in @SQ line: " << line << endl;
+      exit(1);
+    }
+    size_t j = line.find('\t', i + 1);
+    StrView s = line.substr(i + 1, j == StrView::npos? StrView::npos : j - i - 1);
+    if (s.substr(0, 2) == "SN") {
+      contig_name = s.substr(3);
+    } else if (s.substr(0, 2) == "LN") {
+      contig_len = atoll(s.substr(3).str().c_str());
+    }
+    i = j;
+  }
+  // worker threads look up contigs in the same dictionary
+  lock_guard<mutex> lock(dict_mutex);
+  Contig* contig = &dict[contig_name.str()];
+  if (contig->name.length() == 0) {
+    contig->name = contig_name.str();
+    contig->len = contig_len;
+    contig->idx = dict.size() - 1;
+    if (global::verbosity > 0)
+      clog << "added contig [" << contig->name << "] of length [" << contig->len << "]\n";
+  } else {
+    cerr << "error: contig [" << contig->name << "] already exists!" << endl;
+    exit(1);
+  }
+}
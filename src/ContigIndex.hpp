@@ -0,0 +1,59 @@
+#ifndef ContigIndex_hpp_
+#define ContigIndex_hpp_
+
+using namespace std;
+
+#include <vector>
+
+#include "DNASequence.hpp"
+#include "StrView.hpp"
+
+
+// hash index over the contigs of a dictionary, for per-record lookups by name;
+// a miss falls back to the dictionary (adding the contig there if allowed),
+// and the result is remembered; contigs keep their dense dictionary idx;
+// each thread uses its own index, dictionary access is serialized
+class ContigIndex
+{
+public:
+  ContigIndex(SQDict * dict = NULL, bool add_to_dict = false)
+    : dict_(dict), add_to_dict_(add_to_dict), n_(0), slot_(16), last_(NULL) {}
+
+  void init(SQDict * dict, bool add_to_dict) { dict_ = dict; add_to_dict_ = add_to_dict; }
+  // contig with the given name; the record text is used in error messages;
+  // a non-zero len is recorded for contigs of unknown length
+  Contig * find(const StrView & name, const StrView & s, long long int len = 0) {
+    // consecutive records mostly refer to the same contig
+    if (last_ != NULL and name == StrView(last_->name)) return last_;
+    last_ = find_slow(name, s, len);
+    return last_;
+  }
+
+private:
+  class Slot
+  {
+  public:
+    size_t hash;
+    Contig * contig;
+    Slot() : hash(0), contig(NULL) {}
+  };
+
+  SQDict * dict_;
+  bool add_to_dict_;
+  size_t n_;
+  // open addressing with linear probing; size is a power of 2
+  vector<Slot> slot_;
+  Contig * last_;
+
+  static size_t hash(const StrView &);
+  Contig * find_slow(const StrView &, const StrView &, long long int);
+  void insert(size_t, Contig *);
+};
+
+// look up a contig in a dictionary, adding it if allowed; exits if it is missing otherwise
+Contig * get_contig(const StrView &, SQDict *, bool, const StrView &);
+// if this is an @SQ header line, add the contig it describes to the dictionary
+void add_sq_line_to_dict(const StrView &, SQDict &);
+
+
+#endif
@@ -0,0 +1,63 @@
+#include "ExtraSamFlags.hpp"
+
+#include "globals.hpp"
+#include "Cigar.hpp"
+#include "CloneGen.hpp"
+
+
+void
+ExtraSamFlags::apply(const string& s, vector<SamMapping>& v, ostream* err_str) const
+{
+  Clone c;
+
+  for (size_t i = 0; i < v.size(); ++i) {
+    int nip = v[i].flags[7];
+    if (fnp != NULL) {
+      fnp(v[i].name().str(), c, nip); // including rg_dict
+    } else {
+      c.read[nip].len = (v[i].seq() != "*"? v[i].seq().size() : 0);
+      if (global::rg_set.rg_list.size() > 0 and c.pairing == NULL) {
+	c.pairing = get_pairing_from_SamMapping(v[i]);
+      }
+    }
+
+    if (global::rg_set.rg_list.size() > 0 and v[0].flags[2] == 0 and v[1].flags[2] == 0) {
+      Mapping m = convert_SamMapping_to_Mapping(v[i]);
+      m.qr = &c.read[nip];
+      m.is_ref = true;
+      c.read[nip].mapping.push_back(m);
+    }
+
+    if (c.read[nip].len < min_read_len) {
+      v[i].flags[16] = 1;
+    }
+
+    if (v[i].flags[2] == 0) { // mapped
+      if (v[i].mqv >= min_mqv) {
+	v[i].flags[12] = 1;
+      }
+      if (min_tail_insert_size > 0) {
+	vector<int> tails(2);
+	get_tail_insert_size(v[i].cigar(), min_tail_match_len, tails);
+	if (tails[0] >= min_tail_insert_size) {
+	  v[i].flags[13] = 1;
+	}
+	if (tails[1] >= min_tail_insert_size) {
+	  v[i].flags[14] = 1;
+	}
+      }
+    }
+  }
+
+  if (global::rg_set.rg_list.size() > 0 and v[0].flags[2] == 0 and v[1].flags[2] == 0) {
+    if (c.pairing->pair_concordant(c.read[0].mapping[0], 0, c.read[1].mapping[0], 0)) {
+      v[0].flags[15] = 1;
+      v[1].flags[15] = 1;
+      if (err_str != NULL && global::verbosity > 0)
+	*err_str << "clone s=" << s << ": concordant\n";
+    } else {
+      if (err_str != NULL && global::verbosity > 0)
+	*err_str << "clone s=" << s << ": discordant\n";
+    }
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef ExtraSamFlags_hpp_
+#define ExtraSamFlags_hpp_
+
+using namespace std;
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "Clone.hpp"
+#include "SamMapping.hpp"
+
+
+// the flags add-extra-sam-flags sets beyond the SAM ones: 0x1000 for mappings with
+// quality at least min_mqv, 0x2000 and 0x4000 for unaligned tails of at least
+// min_tail_insert_size, 0x8000 for both mates of a concordant pair, and 0x10000 for
+// reads shorter than min_read_len
+class ExtraSamFlags
+{
+public:
+  int min_read_len;
+  int min_mqv;
+  int min_tail_insert_size;
+  int min_tail_match_len;
+  // parser of full read names, which also sets the read group; without one, reads
+  // are looked up by their RG tag or the default read group
+  void (*fnp)(const string&, Clone&, int&);
+
+  ExtraSamFlags()
+    : min_read_len(20),
+      min_mqv(5),
+      min_tail_insert_size(15),
+      min_tail_match_len(5),
+      fnp(NULL) {}
+
+  // set the extra flags on the mappings of clone s: one when there is no pairing
+  // information, otherwise both mates; concordance is reported to err_str under -v
+  void apply(const string & s, vector<SamMapping> & v, ostream * err_str) const;
+};
+
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef FieldSplit_hpp_
+#define FieldSplit_hpp_
+
+using namespace std;
+
+#include <cstddef>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// split [p, p + len) at delim, storing field start offsets in start[0..n], where n is
+// the number of fields split off (at most max_fields); field i occupies
+// [start[i], start[i + 1] - 1); if the line has more fields, start[n] is the offset
+// of the unsplit remainder, otherwise it is len + 1
+inline int
+split_fields(const char * p, size_t len, char delim, int * start, int max_fields)
+{
+  int n = 0;
+  start[0] = 0;
+  if (max_fields <= 0) return 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  // compare 16 bytes at a time, then walk the bits of the match mask
+  const __m128i d = _mm_set1_epi8(delim);
+  for (; i + 16 <= len; i += 16) {
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), d));
+    while (mask != 0) {
+      start[++n] = int(i + __builtin_ctz(mask) + 1);
+      if (n == max_fields) return n;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  while (i < len) {
+    const char * q = (const char *)memchr(p + i, delim, len - i);
+    if (q == NULL) break;
+    i = q - p + 1;
+    start[++n] = int(i);
+    if (n == max_fields) return n;
+  }
+  start[++n] = int(len + 1);
+  return n;
+}
+
+
+#endif
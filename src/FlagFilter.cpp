@@ -0,0 +1,163 @@
+#include "FlagFilter.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+
+namespace {
+  void
+  parse_bitmask(const string& s, unsigned long& must_have, unsigned long& must_not_have)
+  {
+    must_have = 0;
+    must_not_have = 0;
+    size_t i = s.find('/');
+    string one_side = s.substr(0, i);
+    stringstream ss(one_side);
+    ss >> hex >> must_have;
+
+    if (i < s.npos) {
+      one_side = s.substr(i + 1);
+      ss.clear();
+      ss.str(one_side);
+      ss >> hex >> must_not_have;
+    }
+    if (must_have & must_not_have) {
+      cerr << "invalid bitmask: " << s << " (some bits are both set and unset)" << endl;
+      exit(1);
+    }
+  }
+}
+
+
+void
+FilterTable::compile(const vector<Filter>& filters, int n_mates)
+{
+  n_mates_ = n_mates;
+  n_bits_ = 0;
+  compiled_ = false;
+  for (int m = 0; m < n_mates_; ++m) {
+    unsigned long mask = 0;
+    for (size_t i = 0; i < filters.size(); ++i) mask |= filters[i].must_have[m] | filters[i].must_not_have[m];
+    bit_[m].clear();
+    for (int j = 0; j < 32; ++j) if ((mask >> j) & 1) bit_[m].push_back(j);
+    n_bits_ += bit_[m].size();
+  }
+  if (n_bits_ > max_bits) return;
+
+  memset(byte_, 0, sizeof(byte_));
+  int shift = 0;
+  for (int m = 0; m < n_mates_; ++m) {
+    for (size_t j = 0; j < bit_[m].size(); ++j) {
+      int b = bit_[m][j];
+      for (int val = 0; val < 256; ++val)
+	if ((val >> (b % 8)) & 1) byte_[m][b / 8][val] |= 1u << (shift + j);
+    }
+    shift += bit_[m].size();
+  }
+
+  // evaluate the filters in order on one set of flags per entry
+  entry_start_.assign(1, 0);
+  entry_filter_.clear();
+  for (unsigned e = 0; e < (1u << n_bits_); ++e) {
+    unsigned long flags[2];
+    entry_flags(e, flags);
+    for (size_t i = 0; i < filters.size(); ++i) {
+      if (filters[i].matches(flags)) {
+	entry_filter_.push_back(i);
+	if (filters[i].stop_on_hit) break;
+      }
+    }
+    entry_start_.push_back(entry_filter_.size());
+  }
+  compiled_ = true;
+}
+
+void
+FilterTable::entry_flags(unsigned e, unsigned long* flags) const
+{
+  int shift = 0;
+  for (int m = 0; m < n_mates_; ++m) {
+    flags[m] = 0;
+    for (size_t j = 0; j < bit_[m].size(); ++j)
+      if ((e >> (shift + j)) & 1) flags[m] |= 1ul << bit_[m][j];
+    shift += bit_[m].size();
+  }
+}
+
+void
+FilterTable::explain(ostream& os, const vector<Filter>& filters, const vector<string>& dest_name) const
+{
+  os << hex;
+  for (int m = 0; m < n_mates_; ++m) {
+    unsigned long mask = 0;
+    for (size_t j = 0; j < bit_[m].size(); ++j) mask |= 1ul << bit_[m][j];
+    os << "# mate " << m + 1 << ": flag bits looked at: 0x" << mask << '\n';
+  }
+  if (not compiled_) {
+    os << dec << "# " << n_bits_ << " flag bits in total, more than " << max_bits
+       << ": filters are tried in order\n";
+    return;
+  }
+  os << "# entry\tflags (set/unset)\tfilters\tdestinations\n";
+  for (unsigned e = 0; e < (1u << n_bits_); ++e) {
+    unsigned long flags[2];
+    entry_flags(e, flags);
+    os << dec << e << '\t' << hex;
+    for (int m = 0; m < n_mates_; ++m) {
+      unsigned long mask = 0;
+      for (size_t j = 0; j < bit_[m].size(); ++j) mask |= 1ul << bit_[m][j];
+      os << (m > 0? "," : "") << "0x" << flags[m] << "/0x" << (mask & ~flags[m]);
+    }
+    os << dec << '\t';
+    if (entry_begin(e) == entry_end(e)) os << "-\t-";
+    for (const int* p = entry_begin(e); p != entry_end(e); ++p)
+      os << (p != entry_begin(e)? "," : "") << *p;
+    for (const int* p = entry_begin(e); p != entry_end(e); ++p)
+      os << (p != entry_begin(e)? "," : "\t") << dest_name[filters[*p].dest];
+    os << '\n';
+  }
+}
+
+string
+parse_filter(const string& s, int n_mates, Filter& f)
+{
+  size_t i = s.find(':');
+  if (i == s.npos or i + 1 == s.size()) {
+    cerr << "invalid filter: " << s << endl;
+    exit(1);
+  }
+  string conditions = s.substr(0, i);
+  string dest = s.substr(i + 1);
+
+  f.must_have = vector<unsigned long>(n_mates);
+  f.must_not_have = vector<unsigned long>(n_mates);
+  for (int m = 0; m < n_mates; ++m) {
+    i = conditions.find(',');
+    if (m + 1 < n_mates and i == conditions.npos) {
+      cerr << "invalid filter: " << s << endl;
+      exit(1);
+    }
+    parse_bitmask(conditions.substr(0, i), f.must_have[m], f.must_not_have[m]);
+    conditions = (i == conditions.npos? string() : conditions.substr(i + 1));
+  }
+  f.stop_on_hit = (conditions.size() == 0 or atoi(conditions.c_str()) != 0);
+  return dest;
+}
+
+const char * const concordant_filters[] = {
+  "0x10000,0x10000:/dev/null",
+
+  "0x10000,0/0x6004:&1",
+  "0x10000,0:&3",
+  "0/0x6004,0x10000:&1",
+  "0,0x10000:&3",
+
+  "0x4,0:&3",
+  "0,0x4:&3",
+  "0/0x8000,0:&3",
+  "0/0x6000,/0x6000:&1",
+  "0,0:&3",
+};
+const size_t n_concordant_filters = sizeof(concordant_filters) / sizeof(concordant_filters[0]);
@@ -0,0 +1,83 @@
+#ifndef FlagFilter_hpp_
+#define FlagFilter_hpp_
+
+using namespace std;
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+// a filter on the flags of the mappings of a clone, one per mate: a clone passes if
+// each mate has all must_have bits set and all must_not_have bits unset; dest is
+// where the clone goes, as numbered by the user of the filter
+class Filter
+{
+public:
+  vector<unsigned long> must_have;
+  vector<unsigned long> must_not_have;
+  bool stop_on_hit;
+  int dest;
+
+  bool matches(const unsigned long* flags) const {
+    for (size_t i = 0; i < must_have.size(); ++i)
+      if ((flags[i] & must_have[i]) != must_have[i] or (flags[i] & must_not_have[i]) != 0)
+	return false;
+    return true;
+  }
+};
+
+// the filter list compiled into a table indexed by the flag bits some filter looks at,
+// of all mates; each entry lists the filters that match, in order, up to the first one
+// that stops; lists too long to tabulate are scanned one filter at a time instead
+class FilterTable
+{
+public:
+  static const int max_bits = 16;
+
+  FilterTable() : n_mates_(0), n_bits_(0), compiled_(false) {}
+
+  void compile(const vector<Filter>&, int n_mates);
+  bool compiled() const { return compiled_; }
+  // index of the entry for the given flags, one word per mate
+  unsigned index(const unsigned long* flags) const {
+    unsigned res = 0;
+    for (int m = 0; m < n_mates_; ++m) {
+      res |= byte_[m][0][flags[m] & 0xff] | byte_[m][1][(flags[m] >> 8) & 0xff]
+	| byte_[m][2][(flags[m] >> 16) & 0xff] | byte_[m][3][(flags[m] >> 24) & 0xff];
+    }
+    return res;
+  }
+  // matching filters of entry i are entry_filter[entry_start[i]..entry_start[i + 1])
+  const int* entry_begin(unsigned i) const { return entry_filter_.data() + entry_start_[i]; }
+  const int* entry_end(unsigned i) const { return entry_filter_.data() + entry_start_[i + 1]; }
+  // print the table, one line per entry
+  void explain(ostream&, const vector<Filter>&, const vector<string>& dest_name) const;
+
+private:
+  int n_mates_;
+  // flag bit numbers looked at, for each mate
+  vector<int> bit_[2];
+  int n_bits_;
+  bool compiled_;
+  // byte_[m][k][b]: index bits contributed by byte k of the flags of mate m having value b
+  unsigned byte_[2][4][256];
+  vector<int> entry_start_;
+  vector<int> entry_filter_;
+
+  // flags having exactly the bits of entry i set, among the ones looked at
+  void entry_flags(unsigned, unsigned long*) const;
+};
+
+// parse a filter of the form <mate1_mask>[,<mate2_mask>][,<stop_on_hit>]:<dest>, with one
+// mask per mate, each written <must_have_hex>[/<must_not_have_hex>]; stop_on_hit defaults
+// to 1; returns dest, leaving f.dest unset
+string parse_filter(const string &, int n_mates, Filter &);
+
+// the filters of filter-concordant, on pairs: drop the ones with both mates concordant,
+// keep (&1) or remap (&3) the others; used by filter-mappings -C and by extract-discordant
+extern const char * const concordant_filters[];
+extern const size_t n_concordant_filters;
+
+
+#endif
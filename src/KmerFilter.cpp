@@ -0,0 +1,166 @@
+#include "KmerFilter.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+
+namespace
+{
+  const char magic[4] = { 'K', 'M', 'F', '\1' };
+
+  // 2-bit code of a base, 4 for anything else
+  struct BaseCode
+  {
+    unsigned char code[256];
+
+    BaseCode() {
+      memset(code, 4, sizeof(code));
+      code['A'] = code['a'] = 0;
+      code['C'] = code['c'] = 1;
+      code['G'] = code['g'] = 2;
+      code['T'] = code['t'] = 3;
+    }
+  };
+  const BaseCode base_code;
+
+  // the finalizer of splitmix64
+  inline uint64_t
+  mix64(uint64_t x)
+  {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+}
+
+
+void
+KmerFilter::init(int k, size_t n, int bits_per_kmer)
+{
+  if (k < 1 or k > max_k) {
+    cerr << "error: k-mer length must be in [1," << max_k << "]: " << k << endl;
+    exit(1);
+  }
+  k_ = k;
+  // each hash takes 9 bits of a 64-bit hash value
+  n_hashes_ = max(1, min(7, (int)lround(bits_per_kmer * log(2.0))));
+  n_blocks_ = max<size_t>(1, (n * bits_per_kmer + 511) / 512);
+  bits_.assign(n_blocks_ * block_words, 0);
+}
+
+void
+KmerFilter::locate(uint64_t kmer, size_t & block, uint64_t & h) const
+{
+  h = mix64(kmer);
+  // the high half picks the block; the low one, shuffled again, the bits
+  block = (size_t)(((h >> 32) * (unsigned long long int)n_blocks_) >> 32);
+  h = mix64(h ^ 0x9e3779b97f4a7c15ull);
+}
+
+template <class F>
+void
+KmerFilter::for_each_kmer(const char * s, size_t len, F f) const
+{
+  const uint64_t mask = (k_ == 32? ~0ull : (1ull << (2 * k_)) - 1);
+  const int shift = 2 * (k_ - 1);
+  uint64_t fw = 0;
+  uint64_t rc = 0;
+  int valid = 0;
+  for (size_t i = 0; i < len; ++i) {
+    unsigned c = base_code.code[(unsigned char)s[i]];
+    if (c > 3) {
+      valid = 0;
+      continue;
+    }
+    fw = ((fw << 2) | c) & mask;
+    rc = (rc >> 2) | ((uint64_t)(3 - c) << shift);
+    if (++valid >= k_ and not f(min(fw, rc)))
+      return;
+  }
+}
+
+void
+KmerFilter::add(const char * s, size_t len)
+{
+  for_each_kmer(s, len, [&] (uint64_t kmer) {
+      size_t block;
+      uint64_t h;
+      locate(kmer, block, h);
+      uint64_t * w = &bits_[block * block_words];
+      for (int i = 0; i < n_hashes_; ++i, h >>= 9)
+	w[(h >> 6) & 7] |= 1ull << (h & 63);
+      return true;
+    });
+}
+
+int
+KmerFilter::count_hits(const char * s, size_t len, int max_hits) const
+{
+  int res = 0;
+  if (k_ == 0) return res;
+  for_each_kmer(s, len, [&] (uint64_t kmer) {
+      size_t block;
+      uint64_t h;
+      locate(kmer, block, h);
+      const uint64_t * w = &bits_[block * block_words];
+      bool found = true;
+      for (int i = 0; found and i < n_hashes_; ++i, h >>= 9)
+	found = (w[(h >> 6) & 7] >> (h & 63)) & 1;
+      if (found) ++res;
+      return res < max_hits;
+    });
+  return res;
+}
+
+double
+KmerFilter::fill_rate() const
+{
+  long long int n = 0;
+  for (size_t i = 0; i < bits_.size(); ++i) n += __builtin_popcountll(bits_[i]);
+  return bits_.size() > 0? double(n) / (64.0 * bits_.size()) : 0.0;
+}
+
+bool
+KmerFilter::save(const string& name) const
+{
+  ofstream out(name.c_str(), ios::binary);
+  if (!out) return false;
+  int32_t header[2] = { k_, n_hashes_ };
+  uint64_t n_blocks = n_blocks_;
+  out.write(magic, sizeof(magic));
+  out.write((const char *)header, sizeof(header));
+  out.write((const char *)&n_blocks, sizeof(n_blocks));
+  out.write((const char *)&bits_[0], n_bytes());
+  return bool(out);
+}
+
+bool
+KmerFilter::load(const string& name)
+{
+  ifstream in(name.c_str(), ios::binary);
+  if (!in) return false;
+  char m[sizeof(magic)];
+  int32_t header[2];
+  uint64_t n_blocks;
+  in.read(m, sizeof(m));
+  in.read((char *)header, sizeof(header));
+  in.read((char *)&n_blocks, sizeof(n_blocks));
+  if (!in or memcmp(m, magic, sizeof(magic)) != 0 or header[0] < 1 or header[0] > max_k
+      or header[1] < 1 or n_blocks == 0) {
+    cerr << "error: not a k-mer filter [" << name << "]" << endl;
+    exit(1);
+  }
+  k_ = header[0];
+  n_hashes_ = header[1];
+  n_blocks_ = n_blocks;
+  bits_.resize(n_blocks_ * block_words);
+  in.read((char *)&bits_[0], n_bytes());
+  if (!in) {
+    cerr << "error: truncated k-mer filter [" << name << "]" << endl;
+    exit(1);
+  }
+  return true;
+}
@@ -0,0 +1,52 @@
+#ifndef KmerFilter_hpp_
+#define KmerFilter_hpp_
+
+using namespace std;
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// blocked Bloom filter of the canonical k-mers of a set of sequences: each k-mer
+// sets a few bits within one 512-bit block, so a lookup touches a single cache line;
+// k-mers with bases other than ACGT are skipped, and case is ignored
+class KmerFilter
+{
+public:
+  static const int max_k = 32;
+  static const int block_words = 8;
+
+  KmerFilter() : k_(0), n_hashes_(0), n_blocks_(0) {}
+
+  // empty filter of k-mers of length k, sized for n k-mers at the given bits per k-mer
+  void init(int k, size_t n, int bits_per_kmer);
+  // add the k-mers of the sequence
+  void add(const char *, size_t);
+  // number of k-mers of the sequence in the filter, counting stops at max_hits
+  int count_hits(const char *, size_t, int max_hits) const;
+
+  // false if the file cannot be written or read; exits on a malformed file
+  bool save(const string &) const;
+  bool load(const string &);
+
+  int k() const { return k_; }
+  size_t n_bytes() const { return bits_.size() * sizeof(uint64_t); }
+  // fraction of bits set
+  double fill_rate() const;
+
+private:
+  int k_;
+  int n_hashes_;
+  size_t n_blocks_;
+  vector<uint64_t> bits_;
+
+  // the bits of the k-mer: block index, and bit offsets in the block
+  void locate(uint64_t, size_t &, uint64_t &) const;
+  // call f on the canonical 2-bit code of each k-mer of the sequence, until it returns false
+  template <class F>
+  void for_each_kmer(const char *, size_t, F) const;
+};
+
+
+#endif
@@ -0,0 +1,192 @@
+#include "MateCollator.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <queue>
+#include <unistd.h>
+
+
+namespace
+{
+  // memory taken by a waiting record beyond its buffer: the object and the table node
+  const size_t waiting_overhead = 96;
+  const size_t run_buffer_size = 1u << 20;
+}
+
+
+MateCollator::MateCollator(size_t max_bytes, const string& tmp_dir, const Emit& emit)
+  : max_bytes_(max_bytes), tmp_dir_(tmp_dir), emit_(emit), bytes_(0), next_seq_(0),
+    n_pairs_(0), n_unmatched_(0), n_spilled_(0), n_runs_(0) {}
+
+MateCollator::~MateCollator()
+{
+  for (size_t i = 0; i < runs_.size(); ++i) fclose(runs_[i]);
+}
+
+void
+MateCollator::add(const StrView& name, const StrView& rec)
+{
+  unordered_map<StrView, unique_ptr<Waiting>, StrViewHash>::iterator it = waiting_.find(name);
+  if (it != waiting_.end()) {
+    emit_(it->second->rec());
+    emit_(rec);
+    ++n_pairs_;
+    bytes_ -= it->second->data.capacity() + waiting_overhead;
+    waiting_.erase(it);
+    return;
+  }
+  unique_ptr<Waiting> w(new Waiting());
+  w->data.reserve(name.size() + rec.size());
+  w->data.append(name.data(), name.size());
+  w->data.append(rec.data(), rec.size());
+  w->name_len = name.size();
+  w->seq = next_seq_++;
+  bytes_ += w->data.capacity() + waiting_overhead;
+  StrView key = w->name();
+  waiting_.emplace(key, move(w));
+  if (bytes_ > max_bytes_) spill();
+}
+
+void
+MateCollator::take_sorted(vector<unique_ptr<Waiting> >& v)
+{
+  v.clear();
+  v.reserve(waiting_.size());
+  for (unordered_map<StrView, unique_ptr<Waiting>, StrViewHash>::iterator it = waiting_.begin();
+       it != waiting_.end(); ++it)
+    v.push_back(move(it->second));
+  waiting_.clear();
+  bytes_ = 0;
+  sort(v.begin(), v.end(), [] (const unique_ptr<Waiting>& a, const unique_ptr<Waiting>& b) {
+      int c = a->name().compare(b->name());
+      return c < 0 or (c == 0 and a->seq < b->seq);
+    });
+}
+
+void
+MateCollator::write_waiting(FILE * f, const Waiting& w)
+{
+  uint32_t len[2] = { (uint32_t)w.name_len, (uint32_t)(w.data.size() - w.name_len) };
+  int64_t seq = w.seq;
+  if (fwrite(len, sizeof(len), 1, f) != 1 or fwrite(&seq, sizeof(seq), 1, f) != 1
+      or fwrite(w.data.data(), 1, w.data.size(), f) != w.data.size()) {
+    cerr << "error writing mate collation run: " << strerror(errno) << endl;
+    exit(1);
+  }
+}
+
+bool
+MateCollator::read_waiting(FILE * f, Waiting& w)
+{
+  uint32_t len[2];
+  int64_t seq;
+  if (fread(len, sizeof(len), 1, f) != 1) return false;
+  w.data.resize(len[0] + len[1]);
+  if (fread(&seq, sizeof(seq), 1, f) != 1
+      or fread(&w.data[0], 1, w.data.size(), f) != w.data.size()) {
+    cerr << "error: truncated mate collation run" << endl;
+    exit(1);
+  }
+  w.name_len = len[0];
+  w.seq = seq;
+  return true;
+}
+
+void
+MateCollator::spill()
+{
+  vector<unique_ptr<Waiting> > v;
+  take_sorted(v);
+  string name = tmp_dir_ + "/sam-collate.XXXXXX";
+  int fd = mkstemp(&name[0]);
+  if (fd < 0) {
+    cerr << "error creating mate collation run [" << name << "]: " << strerror(errno) << endl;
+    exit(1);
+  }
+  // the file goes away when it is closed
+  unlink(name.c_str());
+  FILE * f = fdopen(fd, "w+b");
+  setvbuf(f, NULL, _IOFBF, run_buffer_size);
+  for (size_t i = 0; i < v.size(); ++i) write_waiting(f, *v[i]);
+  if (fflush(f) != 0) {
+    cerr << "error writing mate collation run: " << strerror(errno) << endl;
+    exit(1);
+  }
+  runs_.push_back(f);
+  ++n_runs_;
+  n_spilled_ += v.size();
+}
+
+void
+MateCollator::collate_group(vector<const Waiting *>& group)
+{
+  const Waiting * w = NULL;
+  for (size_t i = 0; i < group.size(); ++i) {
+    if (w == NULL) {
+      w = group[i];
+      continue;
+    }
+    emit_(w->rec());
+    emit_(group[i]->rec());
+    ++n_pairs_;
+    w = NULL;
+  }
+  if (w != NULL) {
+    if (n_unmatched_++ == 0) unmatched_example_ = w->rec().str();
+  }
+}
+
+void
+MateCollator::finish()
+{
+  vector<unique_ptr<Waiting> > mem;
+  take_sorted(mem);
+  // sources of the merge: the runs, then the records still in memory
+  size_t n_src = runs_.size() + 1;
+  size_t mem_i = 0;
+  vector<Waiting> crt(n_src);
+  auto next = [&] (size_t i) {
+    if (i < runs_.size()) return read_waiting(runs_[i], crt[i]);
+    if (mem_i == mem.size()) return false;
+    crt[i] = move(*mem[mem_i]);
+    mem[mem_i++].reset();
+    return true;
+  };
+  auto greater = [&] (size_t a, size_t b) {
+    int c = crt[a].name().compare(crt[b].name());
+    return c > 0 or (c == 0 and crt[a].seq > crt[b].seq);
+  };
+  priority_queue<size_t, vector<size_t>, decltype(greater)> heap(greater);
+  for (size_t i = 0; i < n_src; ++i) {
+    if (i < runs_.size()) rewind(runs_[i]);
+    if (next(i)) heap.push(i);
+  }
+  // records of one name come out together, in input order
+  vector<Waiting> group;
+  vector<const Waiting *> group_p;
+  while (not heap.empty()) {
+    group.clear();
+    do {
+      size_t i = heap.top();
+      heap.pop();
+      group.push_back(move(crt[i]));
+      if (next(i)) heap.push(i);
+    } while (not heap.empty() and crt[heap.top()].name() == group[0].name());
+    group_p.clear();
+    for (size_t j = 0; j < group.size(); ++j) group_p.push_back(&group[j]);
+    collate_group(group_p);
+  }
+  for (size_t i = 0; i < runs_.size(); ++i) fclose(runs_[i]);
+  runs_.clear();
+}
+
+void
+MateCollator::print_stats(ostream& os) const
+{
+  os << "mate collator: " << n_pairs_ << " pairs; " << n_spilled_ << " records spilled to "
+     << n_runs_ << " runs; " << n_unmatched_ << " records without mates\n";
+}
@@ -0,0 +1,94 @@
+#ifndef MateCollator_hpp_
+#define MateCollator_hpp_
+
+using namespace std;
+
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "StrView.hpp"
+
+
+// pairs up the records of mates that come in any order, such as sorted by coordinate:
+// a record waits in memory, keyed by its clone name, until its mate shows up, and then
+// both are emitted, the waiting one first; when the waiting records take more than the
+// memory cap, they are spilled to a run file sorted by name, and at the end the runs
+// are merged with what is left in memory to pair the rest; records are opaque bytes
+class MateCollator
+{
+public:
+  typedef function<void(const StrView &)> Emit;
+
+  // runs go to unlinked temporary files in tmp_dir
+  MateCollator(size_t, const string &, const Emit &);
+  ~MateCollator();
+
+  // a record of the clone with the given name
+  void add(const StrView &, const StrView &);
+  // merge the runs, and emit the pairs they complete; records left without a mate are dropped
+  void finish();
+
+  long long int n_pairs() const { return n_pairs_; }
+  long long int n_unmatched() const { return n_unmatched_; }
+  int n_runs() const { return n_runs_; }
+  // an example of a record left without a mate
+  const string & unmatched_example() const { return unmatched_example_; }
+  void print_stats(ostream &) const;
+
+private:
+  // the name and the record, in one buffer; name is a view of its start
+  class Waiting
+  {
+  public:
+    string data;
+    size_t name_len;
+    long long int seq;
+
+    StrView name() const { return StrView(data.data(), name_len); }
+    StrView rec() const { return StrView(data.data() + name_len, data.size() - name_len); }
+  };
+
+  class StrViewHash
+  {
+  public:
+    size_t operator ()(const StrView & s) const {
+      // FNV-1a
+      size_t h = 14695981039346656037ull;
+      for (size_t i = 0; i < s.size(); ++i) h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+      return h;
+    }
+  };
+
+  size_t max_bytes_;
+  string tmp_dir_;
+  Emit emit_;
+  // waiting records, keyed by views of their own names
+  unordered_map<StrView, unique_ptr<Waiting>, StrViewHash> waiting_;
+  size_t bytes_;
+  long long int next_seq_;
+  vector<FILE *> runs_;
+  long long int n_pairs_;
+  long long int n_unmatched_;
+  long long int n_spilled_;
+  int n_runs_;
+  string unmatched_example_;
+
+  void spill();
+  // waiting records sorted by name, then input order; the table is emptied
+  void take_sorted(vector<unique_ptr<Waiting> > &);
+  static void write_waiting(FILE *, const Waiting &);
+  static bool read_waiting(FILE *, Waiting &);
+  // pair up the records of one name, in input order, as they would have been in memory
+  void collate_group(vector<const Waiting *> &);
+
+  MateCollator(const MateCollator &);
+  MateCollator & operator =(const MateCollator &);
+};
+
+
+#endif
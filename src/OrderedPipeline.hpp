@@ -0,0 +1,121 @@
+#ifndef OrderedPipeline_hpp_
+#define OrderedPipeline_hpp_
+
+using namespace std;
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <omp.h>
+
+#include "PipelineTuner.hpp"
+
+
+// runs a stream of chunks through three stages: read (serial, in input order),
+// work (in parallel), and write (serial, in input order);
+// chunks live in a ring of window slots that is reused for the whole run, so at most
+// window chunks are between read and write at any time: when the oldest one is slow,
+// reading stops instead of finished chunks piling up behind it;
+// with a tuner, threads numbered from tuner->active_threads() up stay idle
+template <class Chunk>
+class OrderedPipeline
+{
+public:
+  OrderedPipeline(int num_threads, int window)
+    : num_threads_(num_threads > 0? num_threads : 1),
+      slot_(window > 0? window : 1),
+      ready_(slot_.size(), false),
+      tuner_(NULL) {}
+
+  void set_tuner(const PipelineTuner * tuner) { tuner_ = tuner; }
+
+  // read(Chunk &) fills a chunk and returns false at the end of input;
+  // work(Chunk &, int tid) processes a chunk;
+  // write(Chunk &, int tid) outputs a chunk, in the order chunks were read;
+  // chunk slots are reused, so they keep their buffers across calls
+  template <class Read, class Work, class Write>
+  void run(Read read, Work work, Write write);
+
+  // number of slots, i.e., the most chunks in flight
+  int window() const { return slot_.size(); }
+
+private:
+  int num_threads_;
+  vector<Chunk> slot_;
+  vector<bool> ready_;
+  // serializes read()
+  mutex input_mutex_;
+  bool eof_;
+  // guards the counters below
+  mutex mutex_;
+  condition_variable cond_;
+  long long int next_in_;
+  long long int next_out_;
+  bool writing_;
+  const PipelineTuner * tuner_;
+};
+
+
+template <class Chunk>
+template <class Read, class Work, class Write>
+void
+OrderedPipeline<Chunk>::run(Read read, Work work, Write write)
+{
+  long long int window = slot_.size();
+  eof_ = false;
+  next_in_ = 0;
+  next_out_ = 0;
+  writing_ = false;
+
+#pragma omp parallel num_threads(num_threads_)
+  {
+    int tid = omp_get_thread_num();
+    while (true) {
+      if (tuner_ != NULL and tid >= tuner_->active_threads()) {
+	// idle until the tuner wants more threads, or the input ends
+	unique_lock<mutex> lock(mutex_);
+	while (tid >= tuner_->active_threads() and not eof_) cond_.wait(lock);
+      }
+      long long int seq;
+      {
+	lock_guard<mutex> input_lock(input_mutex_);
+	if (eof_) break;
+	{
+	  // backpressure: wait until the slot of chunk next_in_ - window is written
+	  unique_lock<mutex> lock(mutex_);
+	  while (next_in_ - next_out_ >= window) cond_.wait(lock);
+	  seq = next_in_;
+	}
+	if (not read(slot_[seq % window])) {
+	  lock_guard<mutex> lock(mutex_);
+	  eof_ = true;
+	  cond_.notify_all();
+	  break;
+	}
+	lock_guard<mutex> lock(mutex_);
+	++next_in_;
+      }
+
+      work(slot_[seq % window], tid);
+
+      // whichever thread finds the oldest chunk ready writes it, and any that follow
+      unique_lock<mutex> lock(mutex_);
+      ready_[seq % window] = true;
+      if (writing_) continue;
+      writing_ = true;
+      while (ready_[next_out_ % window]) {
+	Chunk & c = slot_[next_out_ % window];
+	lock.unlock();
+	write(c, tid);
+	lock.lock();
+	ready_[next_out_ % window] = false;
+	++next_out_;
+	cond_.notify_all();
+      }
+      writing_ = false;
+    }
+  }
+}
+
+
+#endif
@@ -0,0 +1,110 @@
+#include "OutputWriter.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+
+OutputBuffer::StringBuf::int_type
+OutputBuffer::StringBuf::overflow(int_type c)
+{
+  size_t n = size();
+  s_.resize(max<size_t>(2 * s_.size(), 1u << 16));
+  s_.resize(s_.capacity());
+  setp(&s_[0], &s_[0] + s_.size());
+  pbump(int(n));
+  if (not traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+
+OutputWriter::OutputWriter(size_t max_queued)
+  : max_queued_(max_queued > 0? max_queued : 1),
+    busy_(false),
+    closing_(false),
+    thread_(&OutputWriter::run, this) {}
+
+OutputWriter::~OutputWriter()
+{
+  close();
+}
+
+void
+OutputWriter::write(int fd, string& s)
+{
+  if (s.size() == 0) return;
+  unique_lock<mutex> lock(mutex_);
+  while (queue_.size() >= max_queued_) cond_.wait(lock);
+  queue_.push_back(Job());
+  queue_.back().fd = fd;
+  queue_.back().data.swap(s);
+  if (pool_.size() > 0) {
+    s.swap(pool_.back());
+    pool_.pop_back();
+  }
+  cond_.notify_all();
+}
+
+void
+OutputWriter::flush()
+{
+  unique_lock<mutex> lock(mutex_);
+  while (queue_.size() > 0 or busy_) cond_.wait(lock);
+}
+
+void
+OutputWriter::close()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (closing_) return;
+    closing_ = true;
+    cond_.notify_all();
+  }
+  thread_.join();
+}
+
+void
+OutputWriter::run()
+{
+  unique_lock<mutex> lock(mutex_);
+  while (true) {
+    while (queue_.size() == 0 and not closing_) cond_.wait(lock);
+    if (queue_.size() == 0) break;
+    Job job;
+    job.fd = queue_.front().fd;
+    job.data.swap(queue_.front().data);
+    queue_.pop_front();
+    busy_ = true;
+    cond_.notify_all();
+    lock.unlock();
+
+    const char * p = job.data.data();
+    size_t len = job.data.size();
+    while (len > 0) {
+      ssize_t n = ::write(job.fd, p, len);
+      if (n < 0) {
+	if (errno == EINTR) continue;
+	cerr << "error writing output: " << strerror(errno) << endl;
+	exit(1);
+      }
+      p += n;
+      len -= n;
+    }
+    job.data.clear();
+
+    lock.lock();
+    // keep enough buffers for a full queue, plus the ones in the hands of producers
+    if (pool_.size() < 2 * max_queued_) {
+      pool_.push_back(string());
+      pool_.back().swap(job.data);
+    }
+    busy_ = false;
+    cond_.notify_all();
+  }
+}
@@ -0,0 +1,109 @@
+#ifndef OutputWriter_hpp_
+#define OutputWriter_hpp_
+
+using namespace std;
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// ostream that formats straight into a string buffer; the buffer can be handed over
+// without copying, and keeps its capacity when it is given back
+class OutputBuffer : public ostream
+{
+public:
+  OutputBuffer() : ostream(NULL) { rdbuf(&buf_); }
+
+  const char * data() const { return buf_.data(); }
+  size_t size() const { return buf_.size(); }
+  void clear() { buf_.clear(); }
+  // exchange the contents with s; the stream goes on appending to the storage of s,
+  // whose contents are dropped
+  void swap_buffer(string & s) { buf_.swap_buffer(s); }
+
+private:
+  class StringBuf : public streambuf
+  {
+  public:
+    StringBuf() { reset(); }
+
+    const char * data() const { return s_.data(); }
+    size_t size() const { return pptr() - pbase(); }
+    void clear() { reset(); }
+    void swap_buffer(string & s) {
+      s_.resize(size());
+      s_.swap(s);
+      reset();
+    }
+
+  protected:
+    int_type overflow(int_type);
+
+  private:
+    // s_ is kept at full capacity; the put area marks the part written
+    string s_;
+
+    void reset() {
+      s_.clear();
+      s_.resize(s_.capacity());
+      setp(&s_[0], &s_[0] + s_.size());
+    }
+  };
+
+  StringBuf buf_;
+};
+
+
+// writes buffers to file descriptors from a dedicated thread, in the order they are
+// queued, using large write(2) calls; written buffers are cleared and pooled for reuse;
+// queueing blocks while max_queued buffers are waiting
+class OutputWriter
+{
+public:
+  static const size_t default_max_queued = 16;
+
+  OutputWriter(size_t = default_max_queued);
+  ~OutputWriter();
+
+  // queue the contents of s for writing to fd, leaving an empty pooled buffer in s
+  void write(int, string &);
+  // same, for the contents of an output buffer
+  void write(int fd, OutputBuffer & b) {
+    string s;
+    b.swap_buffer(s);
+    write(fd, s);
+    b.swap_buffer(s);
+  }
+  // wait until everything queued so far is written
+  void flush();
+  // flush and stop the writer thread
+  void close();
+
+private:
+  class Job
+  {
+  public:
+    int fd;
+    string data;
+  };
+
+  size_t max_queued_;
+  mutex mutex_;
+  condition_variable cond_;
+  deque<Job> queue_;
+  vector<string> pool_;
+  bool busy_;
+  bool closing_;
+  thread thread_;
+
+  void run();
+};
+
+
+#endif
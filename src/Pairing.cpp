@@ -5,6 +5,7 @@
 #include "strtk/strtk.hpp"
 #include "Read.hpp"
 #include "globals.hpp"
+#include "FieldSplit.hpp"
 
 void
 Pairing::parse_token(const string& t)
@@ -201,19 +202,15 @@ operator <<(ostream & os, const Pairing& pairing)
 
 ReadGroup::ReadGroup(const string & s)
 {
-  strtk::std_string::token_list_type token_list;
-  strtk::split("\t", s, back_inserter(token_list));
-  if (token_list.size() < 3) {
+  int start[4];
+  if (split_fields(s.data(), s.size(), '\t', start, 3) < 3) {
     cerr << "cannot parse read group line: " << s << endl;
     exit(1);
   }
-  strtk::std_string::token_list_type::iterator itr = token_list.begin();
-  strtk::split(",", string(itr->first, itr->second),
+  strtk::split(",", s.substr(start[0], start[1] - start[0] - 1),
 	       strtk::range_to_type_back_inserter(name));
-  ++itr;
-  num_id = string(itr->first, itr->second);
-  ++itr;
-  pairing = Pairing(string(itr->first, itr->second));
+  num_id = s.substr(start[1], start[2] - start[1] - 1);
+  pairing = Pairing(s.substr(start[2], start[3] - start[2] - 1));
 }
 
 
@@ -0,0 +1,152 @@
+#include "ParallelInflateBuf.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <omp.h>
+
+
+namespace
+{
+  inline size_t
+  get_le(const char * p, int n)
+  {
+    size_t res = 0;
+    for (int i = n - 1; i >= 0; --i) res = (res << 8) | (unsigned char)p[i];
+    return res;
+  }
+
+  // plain input is passed through in pieces of this size
+  const size_t plain_batch = 1u << 20;
+}
+
+
+ParallelInflateBuf::ParallelInflateBuf(istream * in, int num_threads)
+  : in_(in), num_threads_(max(num_threads, 1)), mode_(unknown_mode), n_blocks_(0)
+{
+  zs_.resize(num_threads_);
+  for (int i = 0; i < num_threads_; ++i) {
+    memset(&zs_[i], 0, sizeof(z_stream));
+    if (inflateInit2(&zs_[i], -15) != Z_OK) {
+      cerr << "error: inflateInit2 failed" << endl;
+      exit(1);
+    }
+  }
+}
+
+ParallelInflateBuf::~ParallelInflateBuf()
+{
+  for (int i = 0; i < num_threads_; ++i) inflateEnd(&zs_[i]);
+}
+
+void
+ParallelInflateBuf::detect()
+{
+  // a BGZF block starts with a gzip header with FEXTRA set and a BC subfield
+  head_.resize(16);
+  in_->read(&head_[0], head_.size());
+  head_.resize(in_->gcount());
+  bool bgzf = (head_.size() == 16 and (unsigned char)head_[0] == 31 and (unsigned char)head_[1] == 139
+	       and (unsigned char)head_[2] == 8 and (head_[3] & 4) != 0
+	       and head_[12] == 'B' and head_[13] == 'C');
+  mode_ = (bgzf? bgzf_mode : plain_mode);
+}
+
+bool
+ParallelInflateBuf::read_block(string& s)
+{
+  s.resize(12);
+  size_t n = 0;
+  if (head_.size() > 0) {
+    // only the first block starts in head_, which holds more than the fixed header
+    n = 12;
+    memcpy(&s[0], head_.data(), 12);
+  }
+  in_->read(&s[n], 12 - n);
+  n += in_->gcount();
+  if (n == 0) return false;
+  if (n < 12) {
+    cerr << "error: truncated BGZF block" << endl;
+    exit(1);
+  }
+  size_t xlen = get_le(&s[10], 2);
+  s.resize(12 + xlen);
+  size_t h = 0;
+  if (head_.size() > 0) {
+    h = min(xlen, head_.size() - 12);
+    memcpy(&s[12], head_.data() + 12, h);
+    head_.clear();
+  }
+  in_->read(&s[12 + h], xlen - h);
+  if ((size_t)in_->gcount() != xlen - h) {
+    cerr << "error: truncated BGZF block" << endl;
+    exit(1);
+  }
+  // find the BC subfield, which holds the total block size - 1
+  size_t bsize = 0;
+  for (size_t i = 0; i + 4 <= xlen; i += 4 + get_le(&s[12 + i + 2], 2))
+    if (s[12 + i] == 'B' and s[12 + i + 1] == 'C' and get_le(&s[12 + i + 2], 2) == 2 and i + 6 <= xlen)
+      bsize = get_le(&s[12 + i + 4], 2) + 1;
+  if (bsize < 12 + xlen + 8) {
+    cerr << "error: BGZF block without size" << endl;
+    exit(1);
+  }
+  s.resize(bsize);
+  in_->read(&s[12 + xlen], bsize - 12 - xlen);
+  if ((size_t)in_->gcount() != bsize - 12 - xlen) {
+    cerr << "error: truncated BGZF block" << endl;
+    exit(1);
+  }
+  ++n_blocks_;
+  return true;
+}
+
+void
+ParallelInflateBuf::inflate_block(const string& raw, string& data, z_stream& zs)
+{
+  size_t xlen = get_le(&raw[10], 2);
+  size_t isize = get_le(&raw[raw.size() - 4], 4);
+  data.resize(isize);
+  if (isize == 0) return;
+  inflateReset(&zs);
+  zs.next_in = (Bytef *)&raw[12 + xlen];
+  zs.avail_in = raw.size() - 12 - xlen - 8;
+  zs.next_out = (Bytef *)&data[0];
+  zs.avail_out = isize;
+  if (inflate(&zs, Z_FINISH) != Z_STREAM_END or zs.avail_out != 0) {
+    cerr << "error: bad BGZF block" << endl;
+    exit(1);
+  }
+}
+
+ParallelInflateBuf::int_type
+ParallelInflateBuf::underflow()
+{
+  if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+  if (mode_ == unknown_mode) detect();
+  buf_.clear();
+  if (mode_ == plain_mode) {
+    buf_.swap(head_);
+    if (buf_.size() == 0) {
+      buf_.resize(plain_batch);
+      in_->read(&buf_[0], buf_.size());
+      buf_.resize(in_->gcount());
+    }
+  } else {
+    // skipping empty blocks, such as the end-of-file marker, until some data comes out
+    while (buf_.size() == 0) {
+      if (raw_.size() < batch_blocks) raw_.resize(batch_blocks);
+      size_t n = 0;
+      while (n < batch_blocks and read_block(raw_[n])) ++n;
+      if (n == 0) break;
+      if (data_.size() < n) data_.resize(n);
+#pragma omp parallel for num_threads(num_threads_) schedule(dynamic)
+      for (size_t i = 0; i < n; ++i)
+	inflate_block(raw_[i], data_[i], zs_[omp_get_thread_num()]);
+      for (size_t i = 0; i < n; ++i) buf_ += data_[i];
+    }
+  }
+  if (buf_.size() == 0) return traits_type::eof();
+  setg(&buf_[0], &buf_[0], &buf_[0] + buf_.size());
+  return traits_type::to_int_type(buf_[0]);
+}
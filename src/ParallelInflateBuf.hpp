@@ -0,0 +1,53 @@
+#ifndef ParallelInflateBuf_hpp_
+#define ParallelInflateBuf_hpp_
+
+using namespace std;
+
+#include <istream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+
+// inflates BGZF input with several threads: the compressed blocks of a batch are
+// read in order, then inflated concurrently, and served as one plain stream;
+// input that is not BGZF, including plain gzip, is passed through untouched
+class ParallelInflateBuf : public streambuf
+{
+public:
+  static const size_t batch_blocks = 256;
+
+  ParallelInflateBuf(istream *, int);
+  ~ParallelInflateBuf();
+
+  // known after the first read
+  bool is_bgzf() const { return mode_ == bgzf_mode; }
+  long long int n_blocks() const { return n_blocks_; }
+
+protected:
+  int_type underflow();
+
+private:
+  istream * in_;
+  int num_threads_;
+  enum { unknown_mode, bgzf_mode, plain_mode } mode_;
+  // bytes read while detecting the input type, not yet served
+  string head_;
+  vector<string> raw_;
+  vector<string> data_;
+  vector<z_stream> zs_;
+  string buf_;
+  long long int n_blocks_;
+
+  void detect();
+  // read the next compressed block into s; false at the end of input
+  bool read_block(string &);
+  void inflate_block(const string &, string &, z_stream &);
+
+  ParallelInflateBuf(const ParallelInflateBuf &);
+  ParallelInflateBuf & operator =(const ParallelInflateBuf &);
+};
+
+
+#endif
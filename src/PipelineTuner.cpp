@@ -0,0 +1,89 @@
+#include "PipelineTuner.hpp"
+
+#include <algorithm>
+#include <omp.h>
+
+
+PipelineTuner::PipelineTuner(int num_threads)
+  : max_threads_(num_threads > 0? num_threads : omp_get_max_threads()),
+    auto_threads_(num_threads <= 0),
+    active_threads_(auto_threads_? 1 : max_threads_),
+    chunk_size_(initial_chunk_size),
+    seconds_per_set_(0),
+    bytes_per_set_(0),
+    growing_(auto_threads_ and max_threads_ > 1),
+    probe_start_(0),
+    probe_bytes_(0),
+    best_rate_(0),
+    n_chunks_(0),
+    n_sets_(0),
+    n_bytes_(0),
+    work_seconds_(0),
+    min_seen_(initial_chunk_size),
+    max_seen_(initial_chunk_size) {}
+
+void
+PipelineTuner::chunk_done(int n_sets, size_t n_bytes, double seconds)
+{
+  if (n_sets <= 0) return;
+  ++n_chunks_;
+  n_sets_ += n_sets;
+  n_bytes_ += n_bytes;
+  work_seconds_ += seconds;
+
+  // chunk size: aim for target_seconds of work, changing by at most a factor of 2 at once
+  double w = (n_chunks_ == 1? 1.0 : 0.25);
+  seconds_per_set_ = (1 - w) * seconds_per_set_ + w * seconds / n_sets;
+  bytes_per_set_ = (1 - w) * bytes_per_set_ + w * double(n_bytes) / n_sets;
+  double want = (seconds_per_set_ > 0? target_seconds / seconds_per_set_ : max_chunk_size);
+  if (bytes_per_set_ > 0) want = min(want, max_chunk_bytes / bytes_per_set_);
+  int cur = chunk_size();
+  want = max(want, cur / 2.0);
+  want = min(want, cur * 2.0);
+  int next = int(want);
+  if (next < min_chunk_size) next = min_chunk_size;
+  if (next > max_chunk_size) next = max_chunk_size;
+  chunk_size_.store(next, memory_order_relaxed);
+  min_seen_ = min(min_seen_, next);
+  max_seen_ = max(max_seen_, next);
+
+  // threads: keep adding one while throughput rises by at least min_gain;
+  // when it does not, go back to the previous count and stop
+  if (not growing_) return;
+  double now = omp_get_wtime();
+  if (probe_start_ == 0) {
+    // the first chunk includes start-up costs; measure from its end
+    probe_start_ = now;
+    return;
+  }
+  probe_bytes_ += n_bytes;
+  if (now - probe_start_ < probe_seconds) return;
+  double rate = probe_bytes_ / (now - probe_start_);
+  int active = active_threads();
+  if (rate > (1 + min_gain) * best_rate_) {
+    best_rate_ = rate;
+    if (active < max_threads_) {
+      active_threads_.store(active + 1, memory_order_relaxed);
+    } else {
+      growing_ = false;
+    }
+  } else {
+    active_threads_.store(active - 1, memory_order_relaxed);
+    growing_ = false;
+  }
+  probe_start_ = now;
+  probe_bytes_ = 0;
+}
+
+void
+PipelineTuner::print_stats(ostream & os) const
+{
+  os << "threads: " << active_threads() << " active of " << max_threads_
+     << (auto_threads_? " (automatic)" : "") << '\n'
+     << "chunks: " << n_chunks_ << ", clones per chunk: " << chunk_size()
+     << " (range " << min_seen_ << "-" << max_seen_ << ")"
+     << ", average " << (n_chunks_ > 0? n_sets_ / n_chunks_ : 0)
+     << ", input bytes per chunk: " << (n_chunks_ > 0? n_bytes_ / n_chunks_ : 0)
+     << ", work seconds per chunk: " << (n_chunks_ > 0? work_seconds_ / n_chunks_ : 0)
+     << '\n';
+}
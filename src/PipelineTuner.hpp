@@ -0,0 +1,73 @@
+#ifndef PipelineTuner_hpp_
+#define PipelineTuner_hpp_
+
+using namespace std;
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <ostream>
+#include <string>
+
+
+// picks the number of clones per chunk so that working on a chunk takes about
+// target_seconds, without letting a chunk hold more than max_chunk_bytes of input;
+// with automatic thread selection, it also starts with one worker and adds one at a
+// time for as long as each addition raises throughput;
+// chunk_done() is called once per chunk, in output order; chunk_size() and
+// active_threads() may be read from any thread
+class PipelineTuner
+{
+public:
+  static const int initial_chunk_size = 1000;
+  static const int min_chunk_size = 100;
+  static const int max_chunk_size = 100000;
+  static const size_t max_chunk_bytes = 16 << 20;
+  static constexpr double target_seconds = 0.05;
+  // throughput is measured over this long with each number of threads
+  static constexpr double probe_seconds = 1.0;
+  // an extra thread is kept if it raises throughput by this fraction
+  static constexpr double min_gain = 0.1;
+
+  // a number of threads of 0 or less means automatic selection
+  PipelineTuner(int num_threads);
+
+  // value of a number of threads option: a number, or "auto", which gives 0
+  static int parse_num_threads(const string & s) { return s == "auto"? 0 : atoi(s.c_str()); }
+
+  // number of threads to start, some of which may be kept idle
+  int max_threads() const { return max_threads_; }
+  int active_threads() const { return active_threads_.load(memory_order_relaxed); }
+  // clones to put in the next chunk
+  int chunk_size() const { return chunk_size_.load(memory_order_relaxed); }
+  // account for a chunk of n_sets clones and n_bytes of input that took seconds to work on
+  void chunk_done(int n_sets, size_t n_bytes, double seconds);
+
+  void print_stats(ostream &) const;
+
+private:
+  int max_threads_;
+  bool auto_threads_;
+  atomic<int> active_threads_;
+  atomic<int> chunk_size_;
+
+  // running averages of work time and input bytes per clone
+  double seconds_per_set_;
+  double bytes_per_set_;
+
+  // throughput measurement for the current number of threads
+  bool growing_;
+  double probe_start_;
+  size_t probe_bytes_;
+  double best_rate_;
+
+  long long int n_chunks_;
+  long long int n_sets_;
+  size_t n_bytes_;
+  double work_seconds_;
+  int min_seen_;
+  int max_seen_;
+};
+
+
+#endif
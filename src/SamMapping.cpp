@@ -1,126 +1,159 @@
 #include "SamMapping.hpp"
 
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <map>
 
-#include "strtk/strtk.hpp"
 #include "globals.hpp"
+#include "DNASequence.hpp"
+#include "FieldSplit.hpp"
 
 
-ExtraSamField::ExtraSamField(const string& s)
+void
+SamTagTable::add(unsigned short code, char type, int start, int len, long long int i_val)
 {
-  if (s.length() < 5 || s[2] != ':' || s[4] != ':') {
-    cerr << "invalid SAM field: " << s << endl;
-    exit(1);
+  Entry e;
+  e.code = code;
+  e.type = type;
+  e.start = start;
+  e.len = len;
+  e.i_val = i_val;
+  // keep the probe sequences short; spill the rest
+  if (n_ >= n_inline or find(code) != NULL) {
+    overflow_.push_back(e);
+    return;
   }
-  key = s.substr(0, 2);
-  type = s.substr(3, 1);
-  value = s.substr(5);
+  int i = hash(code);
+  while (slot_[i] != 0) i = (i + 1) & (n_slots - 1);
+  entry_[n_] = e;
+  ++n_;
+  slot_[i] = (unsigned char)n_;
 }
 
-ostream&
-operator <<(ostream& ostr, const ExtraSamField& extraSamField)
+const SamTagTable::Entry *
+SamTagTable::find_overflow(unsigned short code) const
 {
-  ostr << extraSamField.key << ":" << extraSamField.type << ":" << extraSamField.value;
-  return ostr;
+  for (size_t i = 0; i < overflow_.size(); ++i)
+    if (overflow_[i].code == code) return &overflow_[i];
+  return NULL;
 }
 
 
-SamMapping::SamMapping(const string& s, SQDict* dict, bool add_to_dict)
+void
+BamRefTable::add(const StrView& name, long long int len)
 {
-  strtk::std_string::token_list_type token_list;
-  strtk::split("\t", s, back_inserter(token_list));
-  strtk::std_string::token_list_type::iterator itr = token_list.begin();
-  
-  if (itr == token_list.end()) { cerr << "invalid SAM line: " << s << endl; exit(1); }
-  name = string(itr->first, itr->second);
-  ++itr;
-
-  if (itr == token_list.end()) { cerr << "invalid SAM line: " << s << endl; exit(1); }
-  flags = bitset<32>(atol(itr->first));
-  ++itr;
-
-  if (itr == token_list.end()) { cerr << "invalid SAM line: " << s << endl; exit(1); }
-  string tmp = string(itr->first, itr->second);
-  //cerr << "got dbName=[" << tmp << "]" << endl;
-  if (!tmp.compare("*")) {
-    db = NULL;
-  } else {
-    db = &(*dict)[tmp];
-    if (db->name.length() == 0) {
-      if (add_to_dict) {
-	if (global::verbosity > 0)
-	  clog << "adding contig [" << tmp << "]\n";
-	db->name = tmp;
-	db->idx = dict->size() - 1;
-      } else {
-	cerr << "error: missing sequence for contig [" << tmp
-	     << "] referred to in mapping [" << s << "]" << endl;
+  name_.push_back(name.str());
+  len_.push_back(len);
+  contig_.push_back(NULL);
+}
+
+Contig *
+BamRefTable::resolve(int i, const StrView& s)
+{
+  contig_[i] = contigs_->find(name_[i], s, len_[i]);
+  return contig_[i];
+}
+
+
+SamMapping::SamMapping(const string& s, ContigIndex& contigs, unsigned fields)
+{
+  load(s, contigs, fields);
+}
+
+void
+SamMapping::load(const StrView& s, ContigIndex& contigs, unsigned fields)
+{
+  line_.assign(s);
+  bam_ = StrView();
+  bam_block_.reset();
+  parse(contigs, fields);
+}
+
+void
+SamMapping::load(const StrView& s, const LineBlockPtr& block, ContigIndex& contigs, unsigned fields)
+{
+  line_.assign(s, block);
+  bam_ = StrView();
+  bam_block_.reset();
+  parse(contigs, fields);
+}
+
+void
+SamMapping::parse(ContigIndex& contigs, unsigned fields)
+{
+  const char * p = line_.data();
+  size_t len = line_.size();
+  // writing the record back as BAM needs SEQ, QUAL and tags from the text
+  bool want_seq = fields & (load_seq | load_copy);
+  bool want_tags = fields & (load_tags | load_copy);
+  loaded_ = (want_seq? load_seq : 0) | (want_tags? load_tags : 0) | load_line;
+
+  // locate mandatory fields; the last one ends at a tab or at the end of line;
+  // without SEQ, QUAL and tags, stop after TLEN
+  tag_table_.clear();
+  if (not want_seq and not want_tags) {
+    if (split_fields(p, len, '\t', field_start_, 9) < 9 or field_start_[9] > (int)len) {
+      cerr << "invalid SAM line: " << line_.view() << endl;
+      exit(1);
+    }
+    field_start_[10] = field_start_[n_fields] = len + 1;
+  } else if (split_fields(p, len, '\t', field_start_, n_fields) < n_fields) {
+    cerr << "invalid SAM line: " << line_.view() << endl;
+    exit(1);
+  }
+
+  // index optional fields, splitting them off a batch at a time
+  size_t i = want_tags? field_start_[n_fields] : len;
+  while (i < len) {
+    int start[tag_batch + 1];
+    int n = split_fields(p + i, len - i, '\t', start, tag_batch);
+    for (int k = 0; k < n; ++k) {
+      size_t b = i + start[k];
+      size_t e = i + start[k + 1] - 1;
+      if (b == len) break;
+      if (e - b < 5 || p[b + 2] != ':' || p[b + 4] != ':') {
+	cerr << "invalid SAM field: " << StrView(p + b, e - b) << endl;
 	exit(1);
       }
+      tag_table_.add(SAM_TAG(p[b], p[b + 1]), p[b + 3], b + 5, e - b - 5,
+		     is_int_type(p[b + 3])? atoll(p + b + 5) : 0);
     }
-    //cerr << "db now:" << *db << endl;
+    i += start[n];
   }
-  ++itr;
 
-  if (itr == token_list.end()) { cerr << "invalid SAM line: " << s << endl; exit(1); }
-  dbPos = atoll(itr->first);
-  ++itr;
+  flags = bitset<32>(atol(p + field_start_[1]));
 
-  if (itr == token_list.end()) { cerr << "invalid SAM line: " << s << endl; exit(1); }
-  mqv = (int)atol(itr->first);
-  ++itr;
+  StrView tmp = field(2);
+  //cerr << "got dbName=[" << tmp << "]" << endl;
+  if (tmp == "*") {
+    db = NULL;
+  } else {
+    db = contigs.find(tmp, line_.view());
+    //cerr << "db now:" << *db << endl;
+  }
 
-  if (itr == token_list.end()) { cerr << "invalid SAM line: " << s << endl; exit(1); }
-  cigar = string(itr->first, itr->second);
-  ++itr;
+  dbPos = atoll(p + field_start_[3]);
+  mqv = (int)atol(p + field_start_[4]);
 
-  if (itr == token_list.end()) { cerr << "invalid SAM line: " << s << endl; exit(1); }
-  tmp = string(itr->first, itr->second);
-  if (!tmp.compare("*")) {
+  tmp = field(6);
+  if (tmp == "*") {
     mp_db = NULL;
-  } else if (!tmp.compare("=")) {
+  } else if (tmp == "=") {
     mp_db = db;
   } else {
-    mp_db = &(*dict)[tmp];
-    if (mp_db->name.length() == 0) {
-      if (add_to_dict) {
-	if (global::verbosity > 0)
-	  clog << "adding contig [" << tmp << "]\n";
-	mp_db->name = tmp;
-	mp_db->idx = dict->size() - 1;
-      } else {
-	cerr << "error: missing sequence for contig [" << tmp
-	     << "] referred to in mapping [" << s << "]" << endl;
-	exit(1);
-      }
-    }
+    mp_db = contigs.find(tmp, line_.view());
   }
-  ++itr;
-
-  if (itr == token_list.end()) { cerr << "invalid SAM line: " << s << endl; exit(1); }
-  mp_dbPos = atoll(itr->first);
-  ++itr;
 
-  if (itr == token_list.end()) { cerr << "invalid SAM line: " << s << endl; exit(1); }
-  tLen = atoll(itr->first);
-  ++itr;
+  mp_dbPos = atoll(p + field_start_[7]);
+  tLen = atoll(p + field_start_[8]);
 
-  if (itr == token_list.end()) { cerr << "invalid SAM line: " << s << endl; exit(1); }
-  seq = DNASequence(itr->first, itr->second);
-  ++itr;
-
-  if (itr == token_list.end()) { cerr << "invalid SAM line: " << s << endl; exit(1); }
-  qvString = QVString(itr->first, itr->second);
-  ++itr;
-
-  rest = vector<ExtraSamField>();
-  while (itr != token_list.end()) {
-    rest.push_back(ExtraSamField(string(itr->first, itr->second)));
-    ++itr;
-  }
+  set_derived();
+}
 
+void
+SamMapping::set_derived()
+{
   if (!flags[0]) {
     nip = 0;
   } else if (flags[6]) {
@@ -136,10 +169,295 @@ SamMapping::SamMapping(const string& s, SQDict* dict, bool add_to_dict)
   }
 }
 
+namespace {
+  inline int
+  get_le16(const char * p)
+  {
+    const unsigned char * q = (const unsigned char *)p;
+    return q[0] | (q[1] << 8);
+  }
+
+  inline int
+  get_le32(const char * p)
+  {
+    const unsigned char * q = (const unsigned char *)p;
+    return int((unsigned)q[0] | ((unsigned)q[1] << 8) | ((unsigned)q[2] << 16) | ((unsigned)q[3] << 24));
+  }
+
+  inline void
+  write_int(char *& w, long long int v)
+  {
+    char buf[24];
+    char * q = buf + sizeof(buf);
+    unsigned long long int u = (v < 0? -(unsigned long long int)v : v);
+    do {
+      *--q = char('0' + u % 10);
+      u /= 10;
+    } while (u > 0);
+    if (v < 0) *--q = '-';
+    memcpy(w, q, buf + sizeof(buf) - q);
+    w += buf + sizeof(buf) - q;
+  }
+
+  void
+  append_int(string& s, long long int v)
+  {
+    char buf[24];
+    char * w = buf;
+    write_int(w, v);
+    s.append(buf, w - buf);
+  }
+
+  // both bases encoded in one byte of a BAM sequence
+  class SeqPairTable
+  {
+  public:
+    char pair[256][2];
+    SeqPairTable() {
+      static const char seq_codes[] = "=ACMGRSVTWYHKDBN";
+      for (int i = 0; i < 256; ++i) {
+	pair[i][0] = seq_codes[i >> 4];
+	pair[i][1] = seq_codes[i & 0xf];
+      }
+    }
+  };
+  const SeqPairTable seq_pair_table;
+
+  void
+  bad_bam_record(const StrView& rec)
+  {
+    cerr << "error: invalid BAM record of length " << rec.size() << endl;
+    exit(1);
+  }
+
+  // size of a BAM tag value of the given type, or 0 if unknown
+  int
+  bam_type_size(char t)
+  {
+    switch (t) {
+    case 'A': case 'c': case 'C': return 1;
+    case 's': case 'S': return 2;
+    case 'i': case 'I': case 'f': return 4;
+    default: return 0;
+    }
+  }
+
+  // append one numeric BAM value as text; store integers in i_val
+  void
+  append_bam_value(string& s, char t, const char * p, long long int& i_val)
+  {
+    switch (t) {
+    case 'c': i_val = (signed char)p[0]; break;
+    case 'C': i_val = (unsigned char)p[0]; break;
+    case 's': i_val = (short)get_le16(p); break;
+    case 'S': i_val = get_le16(p); break;
+    case 'i': i_val = get_le32(p); break;
+    case 'I': i_val = (unsigned)get_le32(p); break;
+    case 'f':
+      {
+	int tmp = get_le32(p);
+	float f;
+	memcpy(&f, &tmp, 4);
+	char buf[32];
+	s.append(buf, snprintf(buf, sizeof(buf), "%g", f));
+	i_val = 0;
+	return;
+      }
+    }
+    append_int(s, i_val);
+  }
+}
+
+void
+SamMapping::load_bam(const StrView& rec, const LineBlockPtr& block, BamRefTable& refs, unsigned fields)
+{
+  static const char cigar_ops[] = "MIDNSHP=X";
+  // the raw record is kept, so copying it needs none of the text
+  bool want_seq = fields & (load_seq | load_line);
+  bool want_tags = fields & (load_tags | load_line);
+  loaded_ = (want_seq? load_seq : 0) | (want_tags? load_tags : 0) | load_line;
+
+  const char * p = rec.data();
+  const char * p_end = rec.end();
+  if (rec.size() < 32) bad_bam_record(rec);
+  int ref_id = get_le32(p);
+  int pos = get_le32(p + 4);
+  int l_read_name = (unsigned char)p[8];
+  int n_cigar_op = get_le16(p + 12);
+  unsigned long flag = get_le16(p + 14);
+  int l_seq = get_le32(p + 16);
+  int next_ref_id = get_le32(p + 20);
+  int next_pos = get_le32(p + 24);
+  const char * q = p + 32;
+  if (l_seq < 0 or ref_id >= refs.size() or next_ref_id >= refs.size()
+      or (size_t)(p_end - q) < (size_t)l_read_name + 4 * n_cigar_op + (l_seq + 1) / 2 + l_seq)
+    bad_bam_record(rec);
+
+  // extra flags, if present, are the first optional field
+  const char * tags_p = q + l_read_name + 4 * n_cigar_op + (l_seq + 1) / 2 + l_seq;
+  bool have_extra_flags = (p_end - tags_p >= 7 and SAM_TAG(tags_p[0], tags_p[1]) == bam_extra_flags_tag
+			   and tags_p[2] == 'I');
+  if (have_extra_flags) {
+    flag |= (unsigned long)(unsigned)get_le32(tags_p + 3) << 16;
+  }
+  flags = bitset<32>(flag);
+  bam_flags_ = flag;
+  bam_ = rec;
+  bam_block_ = block;
+  mqv = (unsigned char)p[9];
+  dbPos = (long long int)pos + 1;
+  mp_dbPos = (long long int)next_pos + 1;
+  tLen = get_le32(p + 28);
+
+  // compose the mandatory fields through a cursor into a buffer sized for the worst case,
+  // noting field offsets along the way
+  const string * rname = (ref_id < 0? NULL : &refs.name(ref_id));
+  const string * rnext = (next_ref_id < 0 or next_ref_id == ref_id? NULL : &refs.name(next_ref_id));
+  string & s = line_.own_buffer();
+  s.resize(l_read_name + 11 * n_cigar_op + 2 * l_seq + (rname != NULL? rname->size() : 0)
+	   + (rnext != NULL? rnext->size() : 0) + 128);
+  char * const b = &s[0];
+  char * w = b;
+
+  field_start_[0] = 0;
+  if (l_read_name > 0) {
+    memcpy(w, q, l_read_name - 1);
+    w += l_read_name - 1;
+  }
+  q += l_read_name;
+  *w++ = '\t';
+  field_start_[1] = w - b;
+  write_int(w, flag);
+  *w++ = '\t';
+  field_start_[2] = w - b;
+  if (rname == NULL) *w++ = '*'; else { memcpy(w, rname->data(), rname->size()); w += rname->size(); }
+  *w++ = '\t';
+  field_start_[3] = w - b;
+  write_int(w, dbPos);
+  *w++ = '\t';
+  field_start_[4] = w - b;
+  write_int(w, mqv);
+  *w++ = '\t';
+  field_start_[5] = w - b;
+  if (n_cigar_op == 0) *w++ = '*';
+  for (int k = 0; k < n_cigar_op; ++k, q += 4) {
+    unsigned op = (unsigned)get_le32(q);
+    if ((op & 0xf) > 8) bad_bam_record(rec);
+    write_int(w, op >> 4);
+    *w++ = cigar_ops[op & 0xf];
+  }
+  *w++ = '\t';
+  field_start_[6] = w - b;
+  if (next_ref_id < 0) *w++ = '*';
+  else if (rnext == NULL) *w++ = '=';
+  else { memcpy(w, rnext->data(), rnext->size()); w += rnext->size(); }
+  *w++ = '\t';
+  field_start_[7] = w - b;
+  write_int(w, mp_dbPos);
+  *w++ = '\t';
+  field_start_[8] = w - b;
+  write_int(w, tLen);
+  *w++ = '\t';
+  field_start_[9] = w - b;
+  // SEQ and QUAL are left as '*' when not wanted
+  if (l_seq == 0 or not want_seq) *w++ = '*';
+  else {
+    for (int k = 0; k < l_seq / 2; ++k) {
+      memcpy(w, seq_pair_table.pair[(unsigned char)q[k]], 2);
+      w += 2;
+    }
+    if (l_seq % 2 == 1) *w++ = seq_pair_table.pair[(unsigned char)q[l_seq / 2]][0];
+  }
+  q += (l_seq + 1) / 2;
+  *w++ = '\t';
+  field_start_[10] = w - b;
+  if (l_seq == 0 or not want_seq or (unsigned char)q[0] == 0xff) {
+    *w++ = '*';
+  } else {
+    for (int k = 0; k < l_seq; ++k) w[k] = q[k] + 33;
+    w += l_seq;
+  }
+  q += l_seq;
+  s.resize(w - b);
+  field_start_[n_fields] = s.size() + 1;
+
+  // optional fields; all integer types are printed as 'i'
+  tag_table_.clear();
+  if (have_extra_flags) q += 7;
+  if (not want_tags) q = p_end;
+  while (q < p_end) {
+    if (p_end - q < 4) bad_bam_record(rec);
+    unsigned short code = SAM_TAG(q[0], q[1]);
+    char t = q[2];
+    q += 3;
+    s += '\t';
+    s += q[-3];
+    s += q[-2];
+    s += ':';
+    size_t start = s.size() + 2;
+    long long int i_val = 0;
+    char sam_t;
+    if (t == 'Z' or t == 'H') {
+      const char * z = (const char *)memchr(q, '\0', p_end - q);
+      if (z == NULL) bad_bam_record(rec);
+      sam_t = t;
+      s += t;
+      s += ':';
+      s.append(q, z - q);
+      q = z + 1;
+    } else if (t == 'B') {
+      if (p_end - q < 5) bad_bam_record(rec);
+      char sub_t = q[0];
+      int n = get_le32(q + 1);
+      int sz = bam_type_size(sub_t);
+      q += 5;
+      if (sz == 0 or sub_t == 'A' or n < 0 or (p_end - q) / sz < n) bad_bam_record(rec);
+      sam_t = t;
+      s += "B:";
+      s += sub_t;
+      for (int k = 0; k < n; ++k, q += sz) {
+	s += ',';
+	append_bam_value(s, sub_t, q, i_val);
+      }
+      i_val = 0;
+    } else {
+      int sz = bam_type_size(t);
+      if (sz == 0 or p_end - q < sz) bad_bam_record(rec);
+      if (t == 'A') {
+	sam_t = 'A';
+	s += "A:";
+	s += q[0];
+      } else {
+	sam_t = (t == 'f'? 'f' : 'i');
+	s += sam_t;
+	s += ':';
+	append_bam_value(s, t, q, i_val);
+      }
+      q += sz;
+    }
+    tag_table_.add(code, sam_t, start, s.size() - start, i_val);
+  }
+  line_.set_own();
+
+  db = (ref_id < 0? NULL : refs.get(ref_id, line_.view()));
+  mp_db = (next_ref_id < 0? NULL : refs.get(next_ref_id, line_.view()));
+
+  set_derived();
+}
+
+void
+SamMapping::print_line(ostream & os) const
+{
+  StrView l = line();
+  os.write(l.data(), field_start_[1]);
+  os << flags.to_ulong();
+  os.write(l.data() + field_start_[2] - 1, l.size() - (field_start_[2] - 1));
+}
+
 ostream&
 operator <<(ostream& ostr, const SamMapping& samMapping)
 {
-  ostr << "name=[" << samMapping.name << "]"
+  ostr << "name=[" << samMapping.name() << "]"
        << " flags=[" << samMapping.flags.to_string() << "]";
   ostr << " db=[";
   if (samMapping.db == NULL)
@@ -149,7 +467,7 @@ operator <<(ostream& ostr, const SamMapping& samMapping)
   ostr << "]";
   ostr << " dbPos=[" << samMapping.dbPos << "]"
        << " mqv=[" << samMapping.mqv << "]"
-       << " cigar=[" << samMapping.cigar << "]";
+       << " cigar=[" << samMapping.cigar() << "]";
   ostr << " mp_db=[";
   if (samMapping.mp_db == NULL)
     ostr << "*";
@@ -158,11 +476,12 @@ operator <<(ostream& ostr, const SamMapping& samMapping)
   ostr << "]";
   ostr << " mp_dbPos=[" << samMapping.mp_dbPos << "]"
        << " tLen=[" << samMapping.tLen << "]"
-       << " seq=[" << samMapping.seq << "]"
-       << " qvString=[" << samMapping.qvString << "]";
-  vector<ExtraSamField>::const_iterator it;
-  for (it = samMapping.rest.begin(); it != samMapping.rest.end(); ++it) {
-    ostr << " [" << *it << "]";
+       << " seq=[" << samMapping.seq() << "]"
+       << " qvString=[" << samMapping.qvString() << "]";
+  const SamTagTable & t = samMapping.tag_table();
+  for (int i = 0; i < t.size(); ++i) {
+    ostr << " [" << char(t[i].code >> 8) << char(t[i].code & 0xff) << ":" << t[i].type
+	 << ":" << samMapping.tag_value(t[i]) << "]";
   }
 
   return ostr;
@@ -172,15 +491,14 @@ const Pairing *
 get_pairing_from_SamMapping(const SamMapping& m)
 {
   ReadGroup * rg_p;
-  for (size_t i = 0; i < m.rest.size(); ++i) {
-    if (m.rest[i].key == "RG") {
-      rg_p = global::rg_set.find_by_name(m.rest[i].value);
-      if (rg_p == NULL) {
-	cerr << "error: no pairing info for read group: " << m << endl;
-	exit(1);
-      }
-      return rg_p->get_pairing();
+  StrView rg_name;
+  if (m.get_tag(SAM_TAG('R','G'), rg_name)) {
+    rg_p = global::rg_set.find_by_name(rg_name.str());
+    if (rg_p == NULL) {
+      cerr << "error: no pairing info for read group: " << m << endl;
+      exit(1);
     }
+    return rg_p->get_pairing();
   }
 
   rg_p = global::rg_set.find_by_name(global::default_rg_name);
@@ -190,3 +508,51 @@ get_pairing_from_SamMapping(const SamMapping& m)
   }
   return rg_p->get_pairing();
 }
+
+void
+print_fastq_from_SamMapping(ostream& os, const string& s, const SamMapping& m, bool save_rgid)
+{
+  string tail;
+  if (((m.flags.to_ulong() & 0x1) != 0) and m.name() == s) {
+    if ((m.flags.to_ulong() & 0x40) != 0) {
+      tail = "/1";
+    } else {
+      tail = "/2";
+    }
+  }
+  string seq;
+  string qual;
+  if (m.cigar().find('H') == StrView::npos and m.seq() != "*" and m.seq().size() == m.qvString().size()) {
+    if ((m.flags.to_ulong() & 0x10) != 0) {
+      seq = reverseComplement(m.seq().str());
+      qual = reverse(m.qvString().str());
+    } else {
+      seq = m.seq().str();
+      qual = m.qvString().str();
+    }
+  } else {
+    seq = "*";
+    qual = "*";
+  }
+  string rg_num_id;
+  if (save_rgid) {
+    string rg_name;
+    StrView rg_field;
+    if (m.get_tag(SAM_TAG('R','G'), rg_field)) {
+      // found rg name
+      rg_name = rg_field.str();
+    } else {
+      rg_name = global::default_rg_name;
+    }
+    ReadGroup * rg_p = global::rg_set.find_by_name(rg_name);
+    if (rg_p == NULL) {
+      cerr << "missing read group: " << rg_name << "\n";
+      exit(EXIT_FAILURE);
+    }
+    rg_num_id = rg_p->get_num_id();
+  }
+  os << '@' << m.name() << tail << '\n'
+     << seq << '\n'
+     << '+' << rg_num_id << '\n'
+     << qual << '\n';
+}
@@ -3,6 +3,7 @@
 
 using namespace std;
 
+#include <cstring>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -10,48 +11,270 @@ using namespace std;
 
 #include "globals.hpp"
 #include "DNASequence.hpp"
+#include "StrView.hpp"
+#include "BlockLineReader.hpp"
+#include "ContigIndex.hpp"
 
 
-class ExtraSamField
+#define SAM_TAG(_c0, _c1) ((unsigned short)(((unsigned char)(_c0) << 8) | (unsigned char)(_c1)))
+
+
+// optional SAM fields of one record, indexed by their 2-byte tag code;
+// values are stored as offsets into the record line, integer values are parsed on load
+class SamTagTable
 {
 public:
-  string key;
-  string type;
-  string value;
+  class Entry
+  {
+  public:
+    unsigned short code;
+    char type;
+    int start;
+    int len;
+    long long int i_val;
+  };
+
+  static const int n_inline = 16;
+  static const int n_slots = 32;
+
+  SamTagTable() { clear(); }
+
+  void clear() { n_ = 0; overflow_.clear(); memset(slot_, 0, sizeof(slot_)); }
+  void add(unsigned short, char, int, int, long long int);
+  const Entry * find(unsigned short code) const {
+    int i = hash(code);
+    while (slot_[i] != 0) {
+      if (entry_[slot_[i] - 1].code == code) return &entry_[slot_[i] - 1];
+      i = (i + 1) & (n_slots - 1);
+    }
+    return overflow_.size() == 0? NULL : find_overflow(code);
+  }
+  int size() const { return n_ + overflow_.size(); }
+  const Entry & operator [](int i) const { return i < n_? entry_[i] : overflow_[i - n_]; }
+
+private:
+  int n_;
+  Entry entry_[n_inline];
+  vector<Entry> overflow_;
+  // 1 + index into entry_ or 0 if empty; open addressing with linear probing
+  unsigned char slot_[n_slots];
+
+  static int hash(unsigned short code) { return int((code * 2654435761u) >> 27) & (n_slots - 1); }
+  const Entry * find_overflow(unsigned short) const;
+};
+
+
+// text of one record: either a private copy, or a range of a shared input block
+class RecordText
+{
+public:
+  RecordText() : p_(NULL), len_(0) {}
+  RecordText(const RecordText & other) { *this = other; }
+  RecordText(RecordText && other) noexcept { *this = move(other); }
+
+  RecordText & operator =(const RecordText & other) {
+    if (other.block_) {
+      block_ = other.block_;
+      p_ = other.p_;
+      len_ = other.len_;
+    } else {
+      assign(other.view());
+    }
+    return *this;
+  }
+  RecordText & operator =(RecordText && other) noexcept {
+    // swapping the private buffers lets both sides keep some capacity
+    if (other.block_) {
+      block_ = move(other.block_);
+      p_ = other.p_;
+    } else {
+      block_.reset();
+      own_.swap(other.own_);
+      p_ = own_.data();
+    }
+    len_ = other.len_;
+    other.p_ = other.own_.data();
+    other.len_ = 0;
+    return *this;
+  }
+
+  // copy into own buffer, reusing its capacity
+  void assign(const StrView & s) {
+    block_.reset();
+    own_.assign(s.data(), s.size());
+    p_ = own_.data();
+    len_ = s.size();
+  }
+  // refer to a line inside a shared block
+  void assign(const StrView & s, const LineBlockPtr & block) {
+    block_ = block;
+    p_ = s.data();
+    len_ = s.size();
+  }
+  // private buffer to compose a line in; call set_own() when done
+  string & own_buffer() { block_.reset(); own_.clear(); return own_; }
+  void set_own() { p_ = own_.data(); len_ = own_.size(); }
+  // drop the reference to a shared block, if any
+  void release() { block_.reset(); p_ = own_.data(); len_ = 0; }
+
+  const char * data() const { return p_; }
+  size_t size() const { return len_; }
+  StrView view() const { return StrView(p_, len_); }
 
-  ExtraSamField(const string &);
+private:
+  const char * p_;
+  size_t len_;
+  string own_;
+  LineBlockPtr block_;
 };
 
-ostream & operator <<(ostream &, const ExtraSamField &);
 
+// reference sequences listed in a BAM header, resolved to contigs on first use
+class BamRefTable
+{
+public:
+  BamRefTable() : contigs_(NULL) {}
+
+  void init(ContigIndex * contigs) { contigs_ = contigs; }
+  void add(const StrView &, long long int);
+  int size() const { return name_.size(); }
+  const string & name(int i) const { return name_[i]; }
+  // contig for given reference id; the record text is used in error messages
+  Contig * get(int i, const StrView & s) {
+    return contig_[i] != NULL? contig_[i] : resolve(i, s);
+  }
+
+private:
+  vector<string> name_;
+  vector<long long int> len_;
+  vector<Contig *> contig_;
+  ContigIndex * contigs_;
 
+  Contig * resolve(int, const StrView &);
+};
+
+
+// a SAM record keeps its raw line; numeric fields are parsed on load,
+// text fields are exposed as views into the line
 class SamMapping
 {
 public:
-  string name;
+  static const int n_fields = 11;
+  // flags above bit 15 do not fit in a BAM record; they travel in this private tag
+  static const unsigned short bam_extra_flags_tag = SAM_TAG('x','f');
+  // the multiplicity of a collapsed pair, once its name is no longer packed
+  static const unsigned short multiplicity_tag = SAM_TAG('x','m');
+
   bitset<32> flags;
   Contig * db;
   long long int dbPos;
   int mqv;
-  string cigar;
   Contig * mp_db;
   long long int mp_dbPos;
   long long int tLen;
-  DNASequence seq;
-  QVString qvString;
-  vector<ExtraSamField> rest;
 
   int nip;
   int st;
   bool mapped;
   bool is_ref;
 
-  SamMapping() {}
-  SamMapping(const string &, SQDict *, bool);
+  // parts of a record a consumer uses, beyond the mandatory fields other than SEQ and QUAL,
+  // which are always loaded; parts not asked for may be skipped, and read as empty
+  enum {
+    load_seq = 1,	// SEQ and QUAL
+    load_tags = 2,	// optional fields
+    load_line = 4,	// line() holds the complete record text
+    load_copy = 8,	// the record is written back with append_bam_record(), possibly with new flags
+    load_all = 15
+  };
+
+  SamMapping()
+    : db(NULL), dbPos(0), mqv(0), mp_db(NULL), mp_dbPos(0), tLen(0), nip(0), st(0),
+      mapped(false), is_ref(false), bam_flags_(0), loaded_(load_all) {}
+  SamMapping(const string &, ContigIndex &, unsigned = load_all);
+
+  // replace the contents of this record with a copy of the given line, reusing its buffer
+  void load(const StrView &, ContigIndex &, unsigned = load_all);
+  // replace the contents of this record with a line that lives in the given block
+  void load(const StrView &, const LineBlockPtr &, ContigIndex &, unsigned = load_all);
+  // replace the contents of this record with a decoded BAM record (without the block_size prefix)
+  // that lives in the given block
+  void load_bam(const StrView &, const LineBlockPtr &, BamRefTable &, unsigned = load_all);
+  // forget the line, releasing any input block it refers to
+  void release() { line_.release(); bam_ = StrView(); bam_block_.reset(); }
+
+  StrView line() const { return line_.view(); }
+  // print line() with the FLAG field replaced by the current flags, without a newline;
+  // the rest of the line is copied byte for byte
+  void print_line(ostream &) const;
+  StrView field(int i) const {
+    return StrView(line_.data() + field_start_[i], field_start_[i + 1] - field_start_[i] - 1);
+  }
+  StrView name() const { return field(0); }
+  StrView cigar() const { return field(5); }
+  StrView seq() const { return (loaded_ & load_seq)? field(9) : StrView(); }
+  StrView qvString() const { return (loaded_ & load_seq)? field(10) : StrView(); }
+  // all optional fields, tab-separated, as they appear in the input
+  StrView tags() const {
+    return (loaded_ & load_tags) and field_start_[n_fields] < (int)line_.size()?
+      StrView(line_.data() + field_start_[n_fields], line_.size() - field_start_[n_fields])
+      : StrView();
+  }
+  // the BAM record this was decoded from, if any, and its flags at load time
+  StrView bam_record() const { return bam_; }
+  unsigned long bam_flags() const { return bam_flags_; }
+  const SamTagTable & tag_table() const { return tag_table_; }
+  StrView tag_value(const SamTagTable::Entry & e) const { return StrView(line_.data() + e.start, e.len); }
+  bool get_tag(unsigned short code, StrView & value) const {
+    const SamTagTable::Entry * e = tag_table_.find(code);
+    if (e == NULL) return false;
+    value = tag_value(*e);
+    return true;
+  }
+  bool get_int_tag(unsigned short code, long long int & value) const {
+    const SamTagTable::Entry * e = tag_table_.find(code);
+    if (e == NULL or not is_int_type(e->type)) return false;
+    value = e->i_val;
+    return true;
+  }
+  // edit distance and alignment score, if present
+  bool get_nm(int & value) const { return get_int(SAM_TAG('N','M'), value); }
+  bool get_as(int & value) const { return get_int(SAM_TAG('A','S'), value); }
+
+  static bool is_int_type(char t) {
+    return t == 'i' or t == 'c' or t == 'C' or t == 's' or t == 'S' or t == 'I';
+  }
+
+private:
+  RecordText line_;
+  // field i occupies [field_start_[i], field_start_[i + 1] - 1) in line_
+  int field_start_[n_fields + 1];
+  // optional fields are split off this many at a time
+  static const int tag_batch = 16;
+  SamTagTable tag_table_;
+  StrView bam_;
+  LineBlockPtr bam_block_;
+  unsigned long bam_flags_;
+  // parts available, see load_seq etc.
+  unsigned loaded_;
+
+  bool get_int(unsigned short code, int & value) const {
+    long long int tmp;
+    if (not get_int_tag(code, tmp)) return false;
+    value = int(tmp);
+    return true;
+  }
+
+  void parse(ContigIndex &, unsigned);
+  void set_derived();
 };
 
 ostream & operator <<(ostream &, const SamMapping &);
 const Pairing * get_pairing_from_SamMapping(const SamMapping &);
+// print the read of a mapping of clone s as FASTQ, in its original orientation;
+// paired reads named after the clone get a /1 or /2 suffix; with save_rgid, the
+// numeric id of the read group goes after the '+'
+void print_fastq_from_SamMapping(ostream &, const string &, const SamMapping &, bool save_rgid);
 
 
 #endif
@@ -2,56 +2,362 @@
 
 #include <cstdlib>
 #include <cassert>
+#include <cstring>
 #include <iostream>
 
+#include "FieldSplit.hpp"
 
-SamMapping*
-getMapping(istream& istr, void (*headerLineHook)(const string&), SQDict* dict, bool add_to_dict)
+
+namespace {
+  // free list of SamMappingSet objects
+  mutex set_node_mutex;
+  vector<void *> set_node_free_list;
+}
+
+void *
+SamMappingSet::operator new(size_t sz)
+{
+  assert(sz == sizeof(SamMappingSet));
+  {
+    lock_guard<mutex> lock(set_node_mutex);
+    if (set_node_free_list.size() > 0) {
+      void * res = set_node_free_list.back();
+      set_node_free_list.pop_back();
+      return res;
+    }
+  }
+  return ::operator new(sz);
+}
+
+void
+SamMappingSet::operator delete(void * p)
+{
+  lock_guard<mutex> lock(set_node_mutex);
+  set_node_free_list.push_back(p);
+}
+
+SamMappingSet::~SamMappingSet()
+{
+  pool_->put(*this);
+}
+
+
+void
+SamMappingSetPool::get(SamMappingSet& s, vector<SamMapping>& spare)
+{
+  lock_guard<mutex> lock(mutex_);
+  if (names_.size() > 0) {
+    s.first.swap(names_.back());
+    names_.pop_back();
+  }
+  if (vectors_.size() > 0) {
+    s.second.swap(vectors_.back());
+    vectors_.pop_back();
+  }
+  while (spare.size() < spare_batch and records_.size() > 0) {
+    spare.push_back(move(records_.back()));
+    records_.pop_back();
+  }
+}
+
+void
+SamMappingSetPool::put(SamMappingSet& s)
+{
+  lock_guard<mutex> lock(mutex_);
+  for (size_t i = 0; i < s.second.size() and records_.size() < max_records; ++i) {
+    s.second[i].release();
+    records_.push_back(move(s.second[i]));
+  }
+  s.second.clear();
+  if (names_.size() < max_sets) {
+    names_.push_back(string());
+    names_.back().swap(s.first);
+  }
+  if (vectors_.size() < max_sets) {
+    vectors_.push_back(vector<SamMapping>());
+    vectors_.back().swap(s.second);
+  }
+}
+
+
+void
+SamMappingSetGen::detect_format()
+{
+  StrView magic;
+  if (reader_.peek_bytes(4, magic) and magic == StrView("BAM\1", 4)) {
+    format_ = bam_format;
+    load_bam_header();
+  } else {
+    format_ = sam_format;
+  }
+}
+
+namespace {
+  int
+  get_bam_int(BlockLineReader& reader, const char * what)
+  {
+    StrView v;
+    if (not reader.get_bytes(4, v)) {
+      cerr << "error: truncated BAM input while reading " << what << endl;
+      exit(1);
+    }
+    const unsigned char * q = (const unsigned char *)v.data();
+    return int((unsigned)q[0] | ((unsigned)q[1] << 8) | ((unsigned)q[2] << 16) | ((unsigned)q[3] << 24));
+  }
+
+  StrView
+  get_bam_bytes(BlockLineReader& reader, int n, const char * what)
+  {
+    StrView v;
+    if (n < 0 or not reader.get_bytes(n, v)) {
+      cerr << "error: truncated BAM input while reading " << what << endl;
+      exit(1);
+    }
+    return v;
+  }
+}
+
+void
+SamMappingSetGen::load_bam_header()
+{
+  get_bam_bytes(reader_, 4, "magic");
+  int l_text = get_bam_int(reader_, "header length");
+  StrView text = get_bam_bytes(reader_, l_text, "header text");
+  // text is padded with NULs by some writers
+  size_t len = text.find('\0');
+  if (len == StrView::npos) len = text.size();
+  size_t i = 0;
+  while (i < len) {
+    size_t j = text.find('\n', i);
+    if (j == StrView::npos or j > len) j = len;
+    if (j > i and headerLineHook_ != NULL)
+      headerLineHook_(text.substr(i, j - i).str());
+    i = j + 1;
+  }
+
+  int n_ref = get_bam_int(reader_, "reference count");
+  for (int k = 0; k < n_ref; ++k) {
+    int l_name = get_bam_int(reader_, "reference name length");
+    StrView name = get_bam_bytes(reader_, l_name, "reference name");
+    int l_ref = get_bam_int(reader_, "reference length");
+    bam_refs_.add(name.substr(0, l_name > 0? l_name - 1 : 0), l_ref);
+  }
+  // references missing from the dictionary are added in header order
+  if (add_to_dict_)
+    for (int k = 0; k < n_ref; ++k)
+      input_contigs_.find(bam_refs_.name(k), StrView("BAM header"));
+}
+
+bool
+SamMappingSetGen::read_record(StrView& rec, StrView& qname)
 {
-  string line;
-  while (getline(istr, line)) {
-    if (line[0] != '@')
-      return new SamMapping(line, dict, add_to_dict);
-    if (headerLineHook != NULL)
-      headerLineHook(line);
+  if (format_ == unknown_format)
+    detect_format();
+
+  if (format_ == bam_format) {
+    if (not reader_.done()) {
+      int block_size = get_bam_int(reader_, "record length");
+      rec = get_bam_bytes(reader_, block_size, "record");
+      // a malformed record is reported when it is parsed
+      int l_read_name = rec.size() > 8? (unsigned char)rec[8] : 0;
+      qname = rec.substr(32, l_read_name > 0? l_read_name - 1 : 0);
+      ++n_records_;
+      return true;
+    }
+  } else {
+    while (reader_.get_line(rec)) {
+      if (rec.size() == 0 or rec[0] != '@') {
+	qname = rec.substr(0, rec.find('\t'));
+	if (add_to_dict_) add_record_contigs(rec);
+	++n_records_;
+	return true;
+      }
+      if (headerLineHook_ != NULL)
+	headerLineHook_(rec.str());
+    }
   }
-  if (istr.bad()) {
+  if (reader_.bad()) {
     cerr << "error reading SAM mapping" << endl;
     exit(1);
   }
-  return NULL;
+  return false;
 }
 
 
-pair<string,vector<SamMapping> >*
-SamMappingSetGen::get_next()
+void
+SamMappingChunk::clear()
+{
+  rec_.clear();
+  rec_block_.clear();
+  block_.clear();
+  set_name_.clear();
+  set_start_.clear();
+}
+
+bool
+SamMappingSetGen::get_chunk(SamMappingChunk& chunk, int max_sets)
+{
+  chunk.clear();
+  chunk.n_bytes_ = 0;
+  if (pair_mates_)
+    return get_paired_chunk(chunk, max_sets);
+  while (true) {
+    if (not have_pending_) {
+      if (not read_record(pending_, pending_name_))
+	break;
+      have_pending_ = true;
+    }
+    StrView s = cloneNameParser_(pending_name_);
+    if (chunk.set_name_.size() == 0 or chunk.set_name_.back() != s) {
+      // start of new clone; keep the record for the next chunk if this one is full
+      if ((int)chunk.set_name_.size() == max_sets)
+	break;
+      chunk.set_name_.push_back(s);
+      chunk.set_start_.push_back(chunk.rec_.size());
+    }
+    // the pending record lives in the current block until more input is read
+    if (chunk.block_.size() == 0 or chunk.block_.back() != reader_.block())
+      chunk.block_.push_back(reader_.block());
+    chunk.rec_.push_back(pending_);
+    chunk.rec_block_.push_back(chunk.block_.size() - 1);
+    chunk.n_bytes_ += pending_.size();
+    have_pending_ = false;
+  }
+  chunk.set_start_.push_back(chunk.rec_.size());
+  return chunk.size() > 0;
+}
+
+// flags of a raw record, and whether both it and its mate are mapped, to different contigs;
+// a malformed record gives 0, and is reported when it is parsed
+unsigned
+SamMappingSetGen::peek_flags(const StrView& rec, bool& diff_contigs) const
+{
+  unsigned flag;
+  diff_contigs = false;
+  if (format_ == bam_format) {
+    if (rec.size() < 32) return 0;
+    const unsigned char * q = (const unsigned char *)rec.data();
+    flag = q[14] | (q[15] << 8);
+    diff_contigs = (memcmp(q, q + 20, 4) != 0);
+  } else {
+    int start[8];
+    if (split_fields(rec.data(), rec.size(), '\t', start, 7) < 7) return 0;
+    flag = atoi(rec.data() + start[1]);
+    StrView rnext = rec.substr(start[6], start[7] - start[6] - 1);
+    diff_contigs = (rnext != "=" and rnext != rec.substr(start[2], start[3] - start[2] - 1));
+  }
+  if ((flag & 0x1) == 0 or (flag & 0xc) != 0) diff_contigs = false;
+  return flag;
+}
+
+void
+SamMappingSetGen::add_record_contigs(const StrView& rec)
 {
-  pair<string,vector<SamMapping> >* result = NULL;
-  if (next_ != NULL) {
-    result = next_;
-    next_ = NULL;
-  }
-  if (istr_->eof()) {
-    return result;
-  }
-  bool done = false;
-  while (!done) {
-    SamMapping* m = getMapping(*istr_, headerLineHook_, dict_, add_to_dict_);
-    if (m == NULL)
-      break;
-    const string s = cloneNameParser_(m->name);
-    if (result == NULL) {
-      // start of new set; continue
-      result = new pair<string,vector<SamMapping> >(s, vector<SamMapping>(1, *m));
-    } else if (!result->first.compare(s)) {
-      // same clone, add to existing set; continue
-      result->second.push_back(*m);
+  int start[8];
+  if (split_fields(rec.data(), rec.size(), '\t', start, 7) < 7) return;
+  StrView rname = rec.substr(start[2], start[3] - start[2] - 1);
+  StrView rnext = rec.substr(start[6], start[7] - start[6] - 1);
+  if (rname != "*") input_contigs_.find(rname, rec);
+  if (rnext != "*" and rnext != "=") input_contigs_.find(rnext, rec);
+}
+
+bool
+SamMappingSetGen::get_paired_chunk(SamMappingChunk& chunk, int max_sets)
+{
+  StrView rec;
+  StrView qname;
+  while (chunk.size() < max_sets and read_record(rec, qname)) {
+    bool diff_contigs;
+    unsigned flag = peek_flags(rec, diff_contigs);
+    if (drop_diff_chr_ and diff_contigs) {
+      ++n_dropped_;
+      continue;
+    }
+    StrView s = cloneNameParser_(qname);
+    if (flag & 0x1) {
+      s.assign_to(key_);
+      unordered_map<string,LineBlockPtr>::iterator it = waiting_.find(key_);
+      if (it == waiting_.end()) {
+	// the record outlives its input block, so it is copied
+	waiting_[key_] = make_shared<LineBlock>(rec.data(), rec.data() + rec.size());
+	continue;
+      }
+      chunk.set_name_.push_back(s);
+      chunk.set_start_.push_back(chunk.rec_.size());
+      chunk.block_.push_back(it->second);
+      chunk.rec_.push_back(StrView(&(*it->second)[0], it->second->size()));
+      chunk.rec_block_.push_back(chunk.block_.size() - 1);
+      chunk.n_bytes_ += it->second->size();
+      waiting_.erase(it);
     } else {
-      // new set, save it, report the old one
-      next_ = new pair<string,vector<SamMapping> >(s, vector<SamMapping>(1, *m));
-      done = true;
+      chunk.set_name_.push_back(s);
+      chunk.set_start_.push_back(chunk.rec_.size());
+    }
+    if (chunk.block_.size() == 0 or chunk.block_.back() != reader_.block())
+      chunk.block_.push_back(reader_.block());
+    chunk.rec_.push_back(rec);
+    chunk.rec_block_.push_back(chunk.block_.size() - 1);
+    chunk.n_bytes_ += rec.size();
+  }
+  chunk.set_start_.push_back(chunk.rec_.size());
+  if (chunk.size() == 0 and waiting_.size() > 0) {
+    cerr << "warning: " << waiting_.size() << " paired records missed their mates, e.g. ["
+	 << waiting_.begin()->first << "]" << endl;
+    waiting_.clear();
+  }
+  return chunk.size() > 0;
+}
+
+void
+SamMappingSetGen::parse_chunk(SamMappingChunk& chunk, vector<SamMappingSet*>& sets)
+{
+  if (format_ == bam_format and not chunk.bam_refs_ready_) {
+    chunk.bam_refs_ = bam_refs_;
+    chunk.bam_refs_.init(&chunk.contigs_);
+    chunk.bam_refs_ready_ = true;
+  }
+  chunk.contigs_.init(dict_, add_to_dict_);
+
+  sets.resize(chunk.size());
+  for (int i = 0; i < chunk.size(); ++i) {
+    SamMappingSet* res = new SamMappingSet(pool_);
+    pool_->get(*res, chunk.spare_);
+    chunk.set_name_[i].assign_to(res->first);
+    for (int j = chunk.set_start_[i]; j < chunk.set_start_[i + 1]; ++j) {
+      // reuse a recycled record, keeping its buffers
+      if (chunk.spare_.size() > 0) {
+	res->second.push_back(move(chunk.spare_.back()));
+	chunk.spare_.pop_back();
+      } else {
+	res->second.push_back(SamMapping());
+      }
+      const LineBlockPtr& block = chunk.block_[chunk.rec_block_[j]];
+      if (format_ == bam_format)
+	res->second.back().load_bam(chunk.rec_[j], block, chunk.bam_refs_, fields_);
+      else
+	res->second.back().load(chunk.rec_[j], block, chunk.contigs_, fields_);
     }
-    delete m;
+    sets[i] = res;
   }
-  return result;
+  // drop the references to input blocks so the reader can reuse them
+  chunk.clear();
+}
+
+
+SamMappingSet*
+SamMappingSetGen::get_next()
+{
+  if (not get_chunk(chunk_, 1))
+    return NULL;
+  parse_chunk(chunk_, sets_);
+  return sets_[0];
+}
+
+void
+SamMappingSetGen::print_stats(ostream& os) const
+{
+  print_read_stats(os, format_ == bam_format? "BAM records" : "SAM records",
+		   n_records_, reader_.n_bytes(), reader_.seconds());
+  if (drop_diff_chr_)
+    os << "dropped " << n_dropped_ << " records of pairs mapped to different contigs\n";
 }
@@ -4,25 +4,106 @@
 using namespace std;
 
 #include <istream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "SamMapping.hpp"
+#include "StrView.hpp"
+#include "BlockLineReader.hpp"
+
+
+class SamMappingSetPool;
+
+// mappings of one clone; deleting a set hands its storage back to the pool it came from
+class SamMappingSet : public pair<string,vector<SamMapping> >
+{
+public:
+  SamMappingSet(const shared_ptr<SamMappingSetPool> & pool) : pool_(pool) {}
+  ~SamMappingSet();
+
+  static void * operator new(size_t);
+  static void operator delete(void *);
+
+private:
+  shared_ptr<SamMappingSetPool> pool_;
+
+  SamMappingSet(const SamMappingSet &);
+  SamMappingSet & operator =(const SamMappingSet &);
+};
+
+
+// storage recycled across mapping sets: clone names, record vectors, and records
+// (keeping their line buffers); shared by the generator and all sets it hands out
+class SamMappingSetPool
+{
+public:
+  static const size_t spare_batch = 64;
+  // storage kept beyond these is freed, so a burst of large clones does not pin memory
+  static const size_t max_records = 1u << 16;
+  static const size_t max_sets = 1u << 12;
+
+  void get(SamMappingSet &, vector<SamMapping> &);
+  void put(SamMappingSet &);
+
+private:
+  mutex mutex_;
+  vector<string> names_;
+  vector<vector<SamMapping> > vectors_;
+  vector<SamMapping> records_;
+};
+
+
+// records of consecutive clones as read from input, grouped but not yet parsed;
+// filled by SamMappingSetGen::get_chunk() in the input thread and turned into
+// mapping sets by SamMappingSetGen::parse_chunk() in a worker; a chunk also keeps
+// the parsing state of the worker that owns it, so it is meant to be reused
+class SamMappingChunk
+{
+public:
+  SamMappingChunk() : n_bytes_(0), bam_refs_ready_(false) {}
+
+  // number of clones
+  int size() const { return set_name_.size(); }
+  // size of the records last read into the chunk; kept after parsing
+  size_t n_bytes() const { return n_bytes_; }
+
+private:
+  friend class SamMappingSetGen;
+
+  // SAM lines or BAM records (without the block_size prefix), and the blocks they live in
+  vector<StrView> rec_;
+  vector<int> rec_block_;
+  vector<LineBlockPtr> block_;
+  // clone i consists of records [set_start_[i], set_start_[i + 1])
+  vector<StrView> set_name_;
+  vector<int> set_start_;
+  size_t n_bytes_;
+
+  ContigIndex contigs_;
+  BamRefTable bam_refs_;
+  bool bam_refs_ready_;
+  // records taken from the pool, owned by the chunk until moved into a set
+  vector<SamMapping> spare_;
+
+  void clear();
+};
 
 
 class SamMappingSetGen
 {
 public:
   istream *istr_;
-  string (*cloneNameParser_)(const string&);
+  StrView (*cloneNameParser_)(const StrView&);
   void (*headerLineHook_)(const string&);
   SQDict *dict_;
   bool add_to_dict_;
 
-  pair<string,vector<SamMapping> >* next_;
 
   SamMappingSetGen(istream* istr,
-		   string (*cloneNameParser)(const string&),
+		   StrView (*cloneNameParser)(const StrView&),
 		   void (*headerLineHook)(const string&),
 		   SQDict* dict, bool add_to_dict)
     : istr_(istr),
@@ -30,9 +111,68 @@ public:
       headerLineHook_(headerLineHook),
       dict_(dict),
       add_to_dict_(add_to_dict),
-      next_(NULL) {}
+      pool_(new SamMappingSetPool()),
+      reader_(istr),
+      input_contigs_(dict, add_to_dict),
+      format_(unknown_format),
+      n_records_(0),
+      have_pending_(false),
+      fields_(SamMapping::load_all),
+      pair_mates_(false),
+      drop_diff_chr_(false),
+      n_dropped_(0) {}
+
+  // parts of each record the consumer uses, from SamMapping::load_seq etc.;
+  // the rest may be skipped by the parser
+  void set_fields(unsigned fields) { fields_ = fields; }
+  // group the records of input in any order, such as sorted by coordinate, into mate
+  // pairs: a paired record is held until its mate shows up, and then both form a set,
+  // in input order; unpaired records form sets of their own; with drop_diff_chr,
+  // records of pairs with both mates mapped to different contigs are skipped
+  void set_pair_mates(bool drop_diff_chr) { pair_mates_ = true; drop_diff_chr_ = drop_diff_chr; }
+
+  SamMappingSet* get_next();
+  // read the records of up to the given number of clones, without parsing them;
+  // false at the end of input; only this needs to be serialized across threads
+  bool get_chunk(SamMappingChunk &, int);
+  // parse a chunk into mapping sets, one per clone; safe to run concurrently on different chunks
+  void parse_chunk(SamMappingChunk &, vector<SamMappingSet*> &);
+  // input throughput so far
+  void print_stats(ostream &) const;
+
+private:
+  shared_ptr<SamMappingSetPool> pool_;
+  BlockLineReader reader_;
+  // contigs missing from the dictionary are added by the input thread, so that they get
+  // their indexes in input order, whichever worker parses them
+  ContigIndex input_contigs_;
+  // SAM text or BAM, detected from the first bytes of (decompressed) input
+  enum { unknown_format, sam_format, bam_format } format_;
+  // reference names from the BAM header; each chunk resolves its own copy
+  BamRefTable bam_refs_;
+  long long int n_records_;
+  // record read past the end of the last chunk, and its read name
+  bool have_pending_;
+  StrView pending_;
+  StrView pending_name_;
+  unsigned fields_;
+  // mate pairing: copies of records waiting for their mates, by clone name
+  bool pair_mates_;
+  bool drop_diff_chr_;
+  unordered_map<string,LineBlockPtr> waiting_;
+  string key_;
+  long long int n_dropped_;
+  // used by get_next()
+  SamMappingChunk chunk_;
+  vector<SamMappingSet*> sets_;
 
-  pair<string,vector<SamMapping> >* get_next();
+  void detect_format();
+  void load_bam_header();
+  bool read_record(StrView &, StrView &);
+  bool get_paired_chunk(SamMappingChunk &, int);
+  unsigned peek_flags(const StrView &, bool &) const;
+  // add the contigs a SAM record refers to, if missing, to the dictionary
+  void add_record_contigs(const StrView &);
 };
 
 
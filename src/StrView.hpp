@@ -0,0 +1,70 @@
+#ifndef StrView_hpp_
+#define StrView_hpp_
+
+using namespace std;
+
+#include <cstring>
+#include <ostream>
+#include <string>
+
+
+// non-owning view of a character range;
+// the underlying buffer must outlive the view
+class StrView
+{
+public:
+  static const size_t npos = string::npos;
+
+  StrView() : p_(NULL), len_(0) {}
+  StrView(const char * p, size_t len) : p_(p), len_(len) {}
+  StrView(const char * p) : p_(p), len_(strlen(p)) {}
+  StrView(const string & s) : p_(s.data()), len_(s.size()) {}
+
+  const char * data() const { return p_; }
+  size_t size() const { return len_; }
+  size_t length() const { return len_; }
+  bool empty() const { return len_ == 0; }
+  const char * begin() const { return p_; }
+  const char * end() const { return p_ + len_; }
+  char operator [](size_t i) const { return p_[i]; }
+
+  string str() const { return string(p_, len_); }
+  void assign_to(string & s) const { s.assign(p_, len_); }
+
+  StrView substr(size_t pos, size_t n = npos) const {
+    if (pos > len_) pos = len_;
+    if (n > len_ - pos) n = len_ - pos;
+    return StrView(p_ + pos, n);
+  }
+
+  size_t find(char c, size_t pos = 0) const {
+    if (pos >= len_) return npos;
+    const char * q = (const char *)memchr(p_ + pos, c, len_ - pos);
+    return q != NULL? size_t(q - p_) : npos;
+  }
+
+  int compare(const StrView & other) const {
+    int res = memcmp(p_, other.p_, len_ < other.len_? len_ : other.len_);
+    if (res != 0) return res;
+    return len_ < other.len_? -1 : (len_ > other.len_? 1 : 0);
+  }
+
+  bool operator ==(const StrView & other) const {
+    return len_ == other.len_ and memcmp(p_, other.p_, len_) == 0;
+  }
+  bool operator !=(const StrView & other) const { return not (*this == other); }
+
+private:
+  const char * p_;
+  size_t len_;
+};
+
+inline ostream &
+operator <<(ostream & os, const StrView & v)
+{
+  os.write(v.data(), v.size());
+  return os;
+}
+
+
+#endif
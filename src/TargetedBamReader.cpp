@@ -0,0 +1,236 @@
+#include "TargetedBamReader.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+
+namespace
+{
+  inline int
+  get_le32(const char * p)
+  {
+    const unsigned char * q = (const unsigned char *)p;
+    return (int)(q[0] | (q[1] << 8) | (q[2] << 16) | ((unsigned)q[3] << 24));
+  }
+}
+
+
+TargetedBamReader::TargetedBamReader(const string& name)
+  : name_(name), header_end_(0), skip_diff_contigs_(false), unplaced_(false),
+    phase_(header_phase), chunk_i_(0), in_chunk_(false), n_regions_(0)
+{
+  for (int i = 0; i < done_phase; ++i) n_records_[i] = n_chunks_[i] = 0;
+  if (not reader_.open(name)) {
+    cerr << "error opening BAM file [" << name << "]" << endl;
+    exit(1);
+  }
+  string index_name = find_bam_index(name);
+  if (not index_.load(index_name)) {
+    cerr << "error opening BAM index [" << index_name << "]" << endl;
+    exit(1);
+  }
+  if (not read_header()) {
+    cerr << "error: bad BAM header in [" << name << "]" << endl;
+    exit(1);
+  }
+  region_.resize(ref_id_.size());
+}
+
+bool
+TargetedBamReader::read_header()
+{
+  string s;
+  reader_.seek(0);
+  if (not reader_.read(4, s) or s != string("BAM\1", 4)) return false;
+  header_ = s;
+  if (not reader_.read(4, s)) return false;
+  header_ += s;
+  if (not reader_.read(get_le32(&s[0]), s)) return false;
+  header_ += s;
+  if (not reader_.read(4, s)) return false;
+  header_ += s;
+  int n_ref = get_le32(&s[0]);
+  for (int i = 0; i < n_ref; ++i) {
+    if (not reader_.read(4, s)) return false;
+    header_ += s;
+    int l_name = get_le32(&s[0]);
+    if (l_name <= 0 or not reader_.read(l_name + 4, s)) return false;
+    header_ += s;
+    ref_id_[s.substr(0, l_name - 1)] = i;
+  }
+  header_end_ = reader_.tell();
+  return true;
+}
+
+bool
+TargetedBamReader::add_region(const string& contig, long long int beg, long long int end)
+{
+  map<string,int>::const_iterator it = ref_id_.find(contig);
+  if (it == ref_id_.end()) return false;
+  region_[it->second].push_back(make_pair(max(beg, 0ll), end));
+  ++n_regions_;
+  return true;
+}
+
+void
+TargetedBamReader::start_phase(int phase)
+{
+  phase_ = phase;
+  chunks_.clear();
+  chunk_i_ = 0;
+  in_chunk_ = false;
+  if (phase_ == region_phase) {
+    for (size_t r = 0; r < region_.size(); ++r) {
+      vector<pair<long long int,long long int> >& v = region_[r];
+      sort(v.begin(), v.end());
+      size_t k = 0;
+      for (size_t i = 0; i < v.size(); ++i) {
+	if (k > 0 and v[i].first <= v[k - 1].second)
+	  v[k - 1].second = max(v[k - 1].second, v[i].second);
+	else
+	  v[k++] = v[i];
+      }
+      v.resize(k);
+      for (size_t i = 0; i < v.size(); ++i)
+	index_.query(r, v[i].first, v[i].second, chunks_);
+    }
+  } else if (phase_ == mate_phase) {
+    vector<pair<int,long long int> > pos;
+    for (unordered_map<string,pair<int,long long int> >::const_iterator it = wanted_.begin();
+	 it != wanted_.end(); ++it)
+      pos.push_back(it->second);
+    sort(pos.begin(), pos.end());
+    pos.erase(unique(pos.begin(), pos.end()), pos.end());
+    for (size_t i = 0; i < pos.size(); ++i)
+      index_.query(pos[i].first, pos[i].second, pos[i].second + 1, chunks_);
+  } else if (phase_ == unplaced_phase) {
+    if (unplaced_)
+      chunks_.push_back(BamIndex::Chunk(max(index_.unplaced_offset(), header_end_), ~0ull));
+  }
+  BamIndex::merge(chunks_);
+}
+
+bool
+TargetedBamReader::next_record()
+{
+  while (chunk_i_ < chunks_.size()) {
+    if (not in_chunk_) {
+      reader_.seek(chunks_[chunk_i_].beg);
+      in_chunk_ = true;
+      ++n_chunks_[phase_];
+    }
+    if (reader_.tell() < chunks_[chunk_i_].end and reader_.read(4, rec_)) {
+      string body;
+      int block_size = get_le32(&rec_[0]);
+      if (block_size < 32 or not reader_.read(block_size, body)) {
+	cerr << "error: truncated BAM record in [" << name_ << "]" << endl;
+	exit(1);
+      }
+      rec_ += body;
+      return true;
+    }
+    ++chunk_i_;
+    in_chunk_ = false;
+  }
+  return false;
+}
+
+bool
+TargetedBamReader::overlaps_regions(int ref_id, long long int beg, long long int end) const
+{
+  if (ref_id < 0 or ref_id >= (int)region_.size()) return false;
+  const vector<pair<long long int,long long int> >& v = region_[ref_id];
+  // first region starting at or after end; the one before it is the only candidate
+  vector<pair<long long int,long long int> >::const_iterator it
+    = lower_bound(v.begin(), v.end(), make_pair(end, 0ll));
+  return it != v.begin() and (it - 1)->second > beg;
+}
+
+bool
+TargetedBamReader::keep_record()
+{
+  const char * p = rec_.data() + 4;
+  int ref_id = get_le32(p);
+  long long int pos = get_le32(p + 4);
+  int l_read_name = (unsigned char)p[8];
+  int n_cigar_op = (unsigned char)p[12] | ((unsigned char)p[13] << 8);
+  unsigned flag = (unsigned char)p[14] | ((unsigned char)p[15] << 8);
+  int next_ref_id = get_le32(p + 20);
+  long long int next_pos = get_le32(p + 24);
+  if (rec_.size() < 36 + (size_t)l_read_name + 4 * n_cigar_op or l_read_name < 1) {
+    cerr << "error: malformed BAM record in [" << name_ << "]" << endl;
+    exit(1);
+  }
+
+  if (phase_ == unplaced_phase)
+    return ref_id < 0;
+
+  // reference span, from the CIGAR ops that consume the reference: M, D, N, =, X
+  long long int end = pos;
+  if ((flag & 0x4) == 0) {
+    const char * q = p + 32 + l_read_name;
+    for (int i = 0; i < n_cigar_op; ++i) {
+      unsigned op = (unsigned)get_le32(q + 4 * i);
+      if ((0x18d >> (op & 0xf)) & 1) end += op >> 4;
+    }
+  }
+  if (end == pos) ++end;
+  // records overlapping the regions are the ones of the first phase
+  bool in_regions = overlaps_regions(ref_id, pos, end);
+  string name(p + 32, l_read_name - 1);
+
+  if (phase_ == region_phase) {
+    if (not in_regions) return false;
+    if (flag & 0x1) {
+      unordered_map<string,pair<int,long long int> >::iterator it = wanted_.find(name);
+      if (it != wanted_.end())
+	wanted_.erase(it);
+      else if (next_ref_id >= 0 and not (skip_diff_contigs_ and next_ref_id != ref_id))
+	wanted_[name] = make_pair(next_ref_id, next_pos);
+    }
+    return true;
+  } else {
+    if (in_regions) return false;
+    unordered_map<string,pair<int,long long int> >::iterator it = wanted_.find(name);
+    if (it == wanted_.end() or it->second != make_pair(ref_id, pos)) return false;
+    wanted_.erase(it);
+    return true;
+  }
+}
+
+TargetedBamReader::int_type
+TargetedBamReader::underflow()
+{
+  if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+  out_.clear();
+  if (phase_ == header_phase) {
+    out_ = header_;
+    start_phase(region_phase);
+  }
+  while (out_.size() < batch_size and phase_ != done_phase) {
+    if (not next_record()) {
+      start_phase(phase_ + 1);
+      continue;
+    }
+    if (keep_record()) {
+      out_ += rec_;
+      ++n_records_[phase_];
+    }
+  }
+  if (out_.size() == 0) return traits_type::eof();
+  setg(&out_[0], &out_[0], &out_[0] + out_.size());
+  return traits_type::to_int_type(out_[0]);
+}
+
+void
+TargetedBamReader::print_stats(ostream& os) const
+{
+  os << "targeted BAM input: " << n_regions_ << " regions; "
+     << n_records_[region_phase] << " records from " << n_chunks_[region_phase] << " chunks; "
+     << n_records_[mate_phase] << " mates from " << n_chunks_[mate_phase] << " chunks, "
+     << wanted_.size() << " not found";
+  if (unplaced_)
+    os << "; " << n_records_[unplaced_phase] << " unplaced records";
+  os << "; " << reader_.n_blocks() << " BGZF blocks read\n";
+}
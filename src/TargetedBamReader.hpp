@@ -0,0 +1,78 @@
+#ifndef TargetedBamReader_hpp_
+#define TargetedBamReader_hpp_
+
+using namespace std;
+
+#include <map>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "BamIndex.hpp"
+
+
+// reads the records of an indexed BAM file that overlap a set of regions,
+// and presents them as an uncompressed BAM stream, header first; after the
+// regions, it fetches the mates of paired records whose mates were not among
+// them, from the positions in RNEXT/PNEXT; optionally, it then reads the
+// unplaced records at the end of the file, which are mostly unmapped pairs
+class TargetedBamReader : public streambuf
+{
+public:
+  static const size_t batch_size = 1u << 20;
+
+  // exits if the file or its index cannot be read
+  TargetedBamReader(const string &);
+
+  // add the 0-based interval [beg, end); false if the contig is not in the file
+  bool add_region(const string &, long long int, long long int);
+  // do not fetch mates on other contigs than the records asking for them
+  void set_skip_diff_contigs(bool b) { skip_diff_contigs_ = b; }
+  // after the mates, read the unplaced records
+  void set_unplaced(bool b) { unplaced_ = b; }
+
+  void print_stats(ostream &) const;
+
+protected:
+  int_type underflow();
+
+private:
+  enum { header_phase, region_phase, mate_phase, unplaced_phase, done_phase };
+
+  string name_;
+  BgzfReader reader_;
+  BamIndex index_;
+  string header_;
+  VOffset header_end_;
+  map<string,int> ref_id_;
+  // merged regions of each reference
+  vector<vector<pair<long long int,long long int> > > region_;
+  bool skip_diff_contigs_;
+  bool unplaced_;
+
+  int phase_;
+  vector<BamIndex::Chunk> chunks_;
+  size_t chunk_i_;
+  bool in_chunk_;
+  string rec_;
+  string out_;
+  // paired records seen without their mate, by name: reference and position of the mate
+  unordered_map<string,pair<int,long long int> > wanted_;
+
+  long long int n_regions_;
+  long long int n_records_[done_phase];
+  long long int n_chunks_[done_phase];
+
+  bool read_header();
+  void start_phase(int);
+  // next record of the current phase, including the block_size prefix, in rec_
+  bool next_record();
+  bool keep_record();
+  bool overlaps_regions(int, long long int, long long int) const;
+};
+
+
+#endif
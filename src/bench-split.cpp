@@ -0,0 +1,107 @@
+using namespace std;
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <omp.h>
+
+#include "strtk/strtk.hpp"
+#include "FieldSplit.hpp"
+
+// microbenchmark: tab-split every line of the input with strtk::split into a token list
+// (the old parsing path) and with split_fields into an offsets array;
+// checks that both agree on the number of fields; empty lines are skipped, as strtk
+// gives them no fields and split_fields one
+
+
+int n_reps = 10;
+int max_fields = 64;
+
+
+int
+main(int argc, char* argv[])
+{
+  char c;
+  while ((c = getopt(argc, argv, "r:m:")) != -1) {
+    switch (c) {
+    case 'r':
+      n_reps = atoi(optarg);
+      break;
+    case 'm':
+      max_fields = atoi(optarg);
+      break;
+    default:
+      cerr << "unrecognized option: " << c << endl;
+      exit(1);
+    }
+  }
+
+  if (optind + 1 < argc) {
+    cerr << "use: " << argv[0] << " [-r <reps>] [-m <max_fields>] [<file>]" << endl;
+    exit(1);
+  }
+
+  vector<string> lines;
+  {
+    ifstream f_in;
+    istream * in = &cin;
+    if (optind < argc) {
+      f_in.open(argv[optind]);
+      if (!f_in) {
+	cerr << "error opening file: " << argv[optind] << endl;
+	exit(1);
+      }
+      in = &f_in;
+    }
+    string line;
+    while (getline(*in, line))
+      if (line.size() > 0) lines.push_back(line);
+  }
+  size_t n_bytes = 0;
+  for (size_t i = 0; i < lines.size(); ++i) n_bytes += lines[i].size() + 1;
+
+  long long int strtk_fields = 0;
+  double start = omp_get_wtime();
+  for (int r = 0; r < n_reps; ++r) {
+    for (size_t i = 0; i < lines.size(); ++i) {
+      strtk::std_string::token_list_type token_list;
+      strtk::split("\t", lines[i], back_inserter(token_list));
+      strtk_fields += token_list.size();
+    }
+  }
+  double strtk_seconds = omp_get_wtime() - start;
+
+  long long int split_fields_total = 0;
+  vector<int> field_start(max_fields + 1);
+  start = omp_get_wtime();
+  for (int r = 0; r < n_reps; ++r) {
+    for (size_t i = 0; i < lines.size(); ++i) {
+      const char * p = lines[i].data();
+      size_t len = lines[i].size();
+      // split off max_fields at a time, as the SAM parser does with optional fields
+      size_t j = 0;
+      while (true) {
+	int n = split_fields(p + j, len - j, '\t', &field_start[0], max_fields);
+	split_fields_total += n;
+	if (field_start[n] > int(len - j)) break;
+	j += field_start[n];
+      }
+    }
+  }
+  double split_seconds = omp_get_wtime() - start;
+
+  if (strtk_fields != split_fields_total) {
+    cerr << "error: field counts differ: strtk=" << strtk_fields
+	 << " split_fields=" << split_fields_total << endl;
+    exit(1);
+  }
+  double mb = double(n_bytes) * n_reps / (1024.0 * 1024.0);
+  cout << "lines\t" << lines.size() << "\n"
+       << "fields\t" << strtk_fields / (n_reps > 0? n_reps : 1) << "\n"
+       << "strtk::split\t" << strtk_seconds << " s\t" << mb / strtk_seconds << " MB/s\n"
+       << "split_fields\t" << split_seconds << " s\t" << mb / split_seconds << " MB/s\n";
+  return 0;
+}
@@ -0,0 +1,88 @@
+using namespace std;
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "igzstream.hpp"
+#include "globals.hpp"
+#include "KmerFilter.hpp"
+
+// build the k-mer filter of a TE library from lib.<name>.fa at add-lib time; the alt
+// contigs hold the locus flanks and the inserted sequence, so the reads of pairs that
+// can say anything about a locus share k-mers with them
+
+
+int
+main(int argc, char* argv[])
+{
+  string progName(argv[0]);
+  int k = 25;
+  int bits_per_kmer = 16;
+
+  char c;
+  while ((c = getopt(argc, argv, "k:b:v")) != -1) {
+    switch (c) {
+    case 'k':
+      k = atoi(optarg);
+      break;
+    case 'b':
+      bits_per_kmer = atoi(optarg);
+      if (bits_per_kmer < 1) {
+	cerr << "invalid bits per k-mer: " << optarg << endl;
+	exit(1);
+      }
+      break;
+    case 'v':
+      global::verbosity++;
+      break;
+    default:
+      cerr << "unrecognized option: " << c << endl;
+      exit(1);
+    }
+  }
+
+  if (optind + 2 != argc) {
+    cerr << "use: " << argv[0] << " [-k <k>] [-b <bits_per_kmer>] <lib_fasta> <filter_file>" << endl;
+    exit(1);
+  }
+
+  igzstream in(argv[optind]);
+  if (!in) {
+    cerr << "error opening fasta file: " << argv[optind] << endl;
+    exit(1);
+  }
+  // k-mers span line breaks, so whole sequences are kept; libraries are small
+  vector<string> seq;
+  string line;
+  while (getline(in, line)) {
+    if (line.size() > 0 and line[0] == '>') {
+      seq.push_back(string());
+    } else if (seq.size() == 0) {
+      cerr << "error: fasta file does not start with a header line" << endl;
+      exit(1);
+    } else {
+      seq.back() += line;
+    }
+  }
+  size_t n_kmers = 0;
+  for (size_t i = 0; i < seq.size(); ++i)
+    if (seq[i].size() >= (size_t)k) n_kmers += seq[i].size() - k + 1;
+
+  KmerFilter filter;
+  filter.init(k, n_kmers, bits_per_kmer);
+  for (size_t i = 0; i < seq.size(); ++i)
+    filter.add(seq[i].data(), seq[i].size());
+  if (not filter.save(argv[optind + 1])) {
+    cerr << "error writing k-mer filter: " << argv[optind + 1] << endl;
+    exit(1);
+  }
+
+  if (global::verbosity > 0)
+    clog << "k-mer filter: " << seq.size() << " sequences, " << n_kmers << " " << k << "-mers, "
+	 << filter.n_bytes() << " bytes, " << filter.fill_rate() << " of bits set\n";
+
+  return 0;
+}
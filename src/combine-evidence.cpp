@@ -6,6 +6,7 @@
 #include "strtk/strtk.hpp"
 #include "globals.hpp"
 #include "Fasta.hpp"
+#include "FieldSplit.hpp"
 
 using namespace std;
 
@@ -81,43 +82,30 @@ process_locus(const string & lib_line, const string & ref_evidence_line,
   bool solid_bp[2];
 
   // parse lib line
-  strtk::std_string::token_list_type token_list;
-  strtk::split("\t", lib_line, back_inserter(token_list));
-  if (token_list.size() < 17) {
+  const int n_lib_fields = 17;
+  int start[n_lib_fields + 1];
+  if (split_fields(lib_line.data(), lib_line.size(), '\t', start, n_lib_fields) < n_lib_fields) {
     cerr << "could not parse lib line: " << lib_line << "\n";
     exit(EXIT_FAILURE);
   }
-  auto itr = token_list.begin(); // name
-  locus_name = string(itr->first, itr->second);
-  ++itr; // ref_chr
-  ref_chr = string(itr->first, itr->second);
-  ++itr; // ref_reg_start
-  ++itr; // ref_reg_end
-  ++itr; // ref_tsd0_start
-  ref_tsd[0][0] = atoll(itr->first);
-  ++itr; // ref_tsd0_end
-  ref_tsd[0][1] = atoll(itr->first);
-  ++itr; // ref_tsd1_start
-  s[0] = string(itr->first, itr->second);
-  ++itr; // ref_tsd1_end
-  s[1] = string(itr->first, itr->second);
-  ++itr; // strand
-  ref_strand = (*(itr->first) == '+'? 0 : 1);
-  ++itr; // bp_coverage
-  solid_bp[0] = (*(itr->first) == '1');
-  solid_bp[1] = (*(itr->first + 1) == '1');
-  ++itr; // alt_chr
-  alt_chr = string(itr->first, itr->second);
-  ++itr; // alt_reg_start
-  ++itr; // alt_reg_end
-  ++itr; // alt_tsd0_start
-  alt_tsd[0][0] = atoll(itr->first);
-  ++itr; // alt_tsd0_end
-  alt_tsd[0][1] = atoll(itr->first);
-  ++itr; // alt_tsd1_start
-  s[2] = string(itr->first, itr->second);
-  ++itr; // alt_tsd1_end
-  s[3] = string(itr->first, itr->second);
+  auto field = [&] (int i) { return lib_line.substr(start[i], start[i + 1] - start[i] - 1); };
+  const char * p = lib_line.c_str();
+  locus_name = field(0);
+  ref_chr = field(1);
+  // 2,3: ref_reg_start, ref_reg_end
+  ref_tsd[0][0] = atoll(p + start[4]);
+  ref_tsd[0][1] = atoll(p + start[5]);
+  s[0] = field(6); // ref_tsd1_start
+  s[1] = field(7); // ref_tsd1_end
+  ref_strand = (p[start[8]] == '+'? 0 : 1);
+  solid_bp[0] = (p[start[9]] == '1');
+  solid_bp[1] = (p[start[9] + 1] == '1');
+  alt_chr = field(10);
+  // 11,12: alt_reg_start, alt_reg_end
+  alt_tsd[0][0] = atoll(p + start[13]);
+  alt_tsd[0][1] = atoll(p + start[14]);
+  s[2] = field(15); // alt_tsd1_start
+  s[3] = field(16); // alt_tsd1_end
 
   if (s[0] == ".") {
     is_insertion = true;
@@ -434,9 +422,9 @@ main(int argc, char* argv[])
     string lib_line;
     string ref_evidence_line;
     string alt_evidence_line;
-    bool got_lib_line = getline(lib_is, lib_line);
-    bool got_ref_evidence_line = getline(ref_evidence_is, ref_evidence_line);
-    bool got_alt_evidence_line = getline(alt_evidence_is, alt_evidence_line);
+    bool got_lib_line = bool(getline(lib_is, lib_line));
+    bool got_ref_evidence_line = bool(getline(ref_evidence_is, ref_evidence_line));
+    bool got_alt_evidence_line = bool(getline(alt_evidence_is, alt_evidence_line));
 
     if (got_lib_line != got_ref_evidence_line or got_lib_line != got_alt_evidence_line) {
       cerr << "error reading line " << n_lines+1 << " from lib/ref_evidence/alt_evidence files\n";
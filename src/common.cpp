@@ -8,9 +8,15 @@
 string
 cloneNameParser(const string& name)
 {
-  size_t i = name.find_first_of(':') + 1;
-  size_t j = name.find_first_of(':', i);
-  return string(name.substr(i, j - i));
+  return cloneNameParser(StrView(name)).str();
+}
+
+StrView
+cloneNameParser(const StrView& name)
+{
+  size_t i = name.find(':') + 1;
+  size_t j = name.find(':', i);
+  return name.substr(i, j - i);
 }
 
 void
@@ -33,8 +39,14 @@ fullNameParser(const string& name, Clone& clone, int& nip)
 
   i = j + 1;
   j = name.find(':', i);
-  // next, the clone name, but we already know it
+  // next, the clone name, but we already know it; duplicate pairs collapsed
+  // by fq-trim-pairs -d end it in x<multiplicity>
   //cerr << "clone name: " << name.substr(i, j) << endl;
+  {
+    size_t x = name.find('x', i);
+    if (x < (size_t)j)
+      clone.multiplicity = atoi(&(name.c_str()[x + 1]));
+  }
 
   i = j + 1;
   j = name.find(':', i);
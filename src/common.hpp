@@ -5,9 +5,11 @@
 #include <string>
 
 #include "Clone.hpp"
+#include "StrView.hpp"
 
 
 string cloneNameParser(const string&);
+StrView cloneNameParser(const StrView&);
 void fullNameParser(const string&, Clone&, int&);
 
 
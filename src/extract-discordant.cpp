@@ -0,0 +1,331 @@
+using namespace std;
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+#include "igzstream.hpp"
+#include "globals.hpp"
+#include "SamMapping.hpp"
+#include "SamMappingSetGen.hpp"
+#include "ContigIndex.hpp"
+#include "common.hpp"
+#include "ExtraSamFlags.hpp"
+#include "FlagFilter.hpp"
+#include "OrderedPipeline.hpp"
+#include "PipelineTuner.hpp"
+#include "OutputWriter.hpp"
+#include "TargetedBamReader.hpp"
+
+// stage 2 of getype in one process: read mappings in any order (typically sorted by
+// coordinate), pair mates in memory, give unpaired reads an unmapped dummy mate, set the
+// flags of add-extra-sam-flags, route pairs with the rules of filter-concordant, and
+// print the pairs to remap as FASTQ, as sam-to-fq does;
+// with a list of regions, only pairs with a read near them are extracted, using the BAM index
+
+
+int num_threads = 1;
+bool save_rgid = false;
+ExtraSamFlags extra_flags;
+
+// where filter-concordant sends pairs: nowhere, to stdout (kept), or to fd 3 (remapped)
+enum { dest_drop, dest_keep, dest_remap, n_dests };
+const char * dest_name[n_dests] = { "/dev/null", "&1", "&3" };
+vector<Filter> filter_vector;
+FilterTable filter_table;
+
+// clones going through the pipeline together; chunk objects are reused
+class Chunk
+{
+public:
+  long long int chunk_id;
+  int thread_id;
+  SamMappingChunk input;
+  double work_seconds;
+  vector<SamMappingSet*> sets;
+  // resolves the contigs of dummy mates
+  ContigIndex contigs;
+  string dummy_line;
+  long long int n_pairs[n_dests];
+  long long int n_dummies;
+  OutputBuffer out_str;
+  stringstream err_str;
+
+  Chunk() : contigs(&global::refDict, false) {}
+};
+
+long long int total_pairs[n_dests];
+long long int total_dummies;
+
+
+void
+addSQToRefDict(const string& line)
+{
+  add_sq_line_to_dict(line, global::refDict);
+}
+
+StrView
+default_cnp(const StrView& s)
+{
+  return s;
+}
+
+// as add-dummy-pairs: mark an unpaired read as the first of a pair whose mate is
+// unmapped, and add that mate, placed with the read and carrying its read group
+void
+add_dummy_mate(vector<SamMapping>& v, Chunk& chunk)
+{
+  unsigned long flag = v[0].flags.to_ulong();
+  // set: paired (0x1), mate unmapped (0x8), first (0x40);
+  // clear: properly aligned (0x2), mate reversed (0x20), last (0x80)
+  flag = (flag | 0x49) & ~0xa2ul;
+  v[0].flags = bitset<32>(flag);
+  // set: paired (0x1), unmapped (0x4), last (0x80)
+  unsigned long flag2 = 0x85;
+  if (flag & 0x4) flag2 |= 0x8;
+  if (flag & 0x10) flag2 |= 0x20;
+
+  string& s = chunk.dummy_line;
+  s.clear();
+  s.append(v[0].name().data(), v[0].name().size());
+  s += '\t';
+  s += to_string(flag2);
+  s += "\t*\t0\t0\t*\t";
+  s += (v[0].db != NULL? v[0].db->name : string("*"));
+  s += '\t';
+  s += to_string(v[0].dbPos);
+  s += "\t0\tN\t!";
+  StrView rg;
+  if (v[0].get_tag(SAM_TAG('R','G'), rg)) {
+    s += "\tRG:Z:";
+    s.append(rg.data(), rg.size());
+  }
+  v.push_back(SamMapping());
+  v.back().load(StrView(s), chunk.contigs);
+  ++chunk.n_dummies;
+}
+
+void
+process_mapping_set(const string& s, vector<SamMapping>& v, Chunk& chunk)
+{
+  if (v.size() == 1 and (v[0].flags.to_ulong() & 0x1) == 0) {
+    add_dummy_mate(v, chunk);
+  }
+  if (v.size() != 2) {
+    cerr << "incorrect number of mappings for clone [" << s << "]" << endl;
+    exit(1);
+  }
+
+  extra_flags.apply(s, v, &chunk.err_str);
+
+  unsigned long flags[2] = { v[0].flags.to_ulong(), v[1].flags.to_ulong() };
+  unsigned e = filter_table.index(flags);
+  for (const int* p = filter_table.entry_begin(e); p != filter_table.entry_end(e); ++p) {
+    int dest = filter_vector[*p].dest;
+    ++chunk.n_pairs[dest];
+    if (dest == dest_remap) {
+      print_fastq_from_SamMapping(chunk.out_str, s, v[0], save_rgid);
+      print_fastq_from_SamMapping(chunk.out_str, s, v[1], save_rgid);
+    }
+  }
+}
+
+// regions are lines of <contig> <start> <end>, 0-based and end-exclusive, as in BED;
+// each is extended by pad on both sides, by default the largest fragment of any read group
+void
+load_regions(const string& file, long long int pad, TargetedBamReader& targeted)
+{
+  if (pad < 0) {
+    pad = 0;
+    for (size_t i = 0; i < global::rg_set.rg_list.size(); ++i)
+      if (global::rg_set.rg_list[i].pairing.paired)
+	pad = max<long long int>(pad, global::rg_set.rg_list[i].pairing.max);
+  }
+  igzstream in(file);
+  string line;
+  long long int n_missing = 0;
+  while (getline(in, line)) {
+    if (line.size() == 0 or line[0] == '#') continue;
+    istringstream is(line);
+    string contig;
+    long long int beg;
+    long long int end;
+    if (not (is >> contig >> beg >> end)) {
+      cerr << "error: bad region line [" << line << "] in [" << file << "]" << endl;
+      exit(1);
+    }
+    if (not targeted.add_region(contig, beg - pad, end + pad))
+      ++n_missing;
+  }
+  if (global::verbosity > 0)
+    clog << "regions padded by " << pad << "bp; " << n_missing << " on contigs not in the mappings\n";
+}
+
+
+int
+main(int argc, char* argv[])
+{
+  string progName(argv[0]);
+  string pairing_file;
+  bool drop_diff_chr = false;
+  string regions_file;
+  long long int pad = -1;
+  bool unplaced = false;
+
+  char c;
+  while ((c = getopt(argc, argv, "l:N:g:q:i:dsR:w:uv")) != -1) {
+    switch (c) {
+    case 'l':
+      pairing_file = optarg;
+      break;
+    case 'N':
+      num_threads = PipelineTuner::parse_num_threads(optarg);
+      break;
+    case 'g':
+      global::default_rg_name = optarg;
+      break;
+    case 'q':
+      extra_flags.min_mqv = atoi(optarg);
+      break;
+    case 'i':
+      extra_flags.min_tail_insert_size = atoi(optarg);
+      break;
+    case 'd':
+      drop_diff_chr = true;
+      break;
+    case 's':
+      save_rgid = true;
+      break;
+    case 'R':
+      regions_file = optarg;
+      break;
+    case 'w':
+      pad = atoll(optarg);
+      break;
+    case 'u':
+      unplaced = true;
+      break;
+    case 'v':
+      global::verbosity++;
+      break;
+    default:
+      cerr << "unrecognized option: " << c << endl;
+      exit(1);
+    }
+  }
+
+  if (optind + 1 < argc or pairing_file.size() == 0) {
+    cerr << "use: " << argv[0] << " -l <pairing_file> [options] [<mappings>]" << endl;
+    exit(1);
+  }
+
+  if (global::verbosity > 0)
+    clog << "number of threads: " << (num_threads > 0? to_string(num_threads) : "auto") << '\n';
+
+  {
+    igzstream pairingIn(pairing_file);
+    if (!pairingIn) {
+      cerr << "error opening pairing file: " << pairing_file << "\n";
+      exit(1);
+    }
+    global::rg_set.load(pairingIn);
+  }
+  if (global::rg_set.rg_list.size() == 0) {
+    cerr << "error: no read groups in pairing file: " << pairing_file << endl;
+    exit(1);
+  }
+
+  for (size_t i = 0; i < n_concordant_filters; ++i) {
+    Filter f;
+    string dest = parse_filter(concordant_filters[i], 2, f);
+    f.dest = find(dest_name, dest_name + n_dests, dest) - dest_name;
+    filter_vector.push_back(f);
+  }
+  filter_table.compile(filter_vector, 2);
+
+  // gzip and BGZF input is inflated by the mapping reader
+  unique_ptr<istream> mapIn;
+  unique_ptr<TargetedBamReader> targeted;
+  if (regions_file.size() == 0) {
+    mapIn.reset(new igzstream(optind < argc? argv[optind] : "-", false));
+    if (!*mapIn) {
+      cerr << "error opening mappings file: " << argv[optind] << endl;
+      exit(1);
+    }
+  } else {
+    if (optind >= argc) {
+      cerr << "error: targeted extraction needs an indexed BAM file" << endl;
+      exit(1);
+    }
+    targeted.reset(new TargetedBamReader(argv[optind]));
+    targeted->set_skip_diff_contigs(drop_diff_chr);
+    targeted->set_unplaced(unplaced);
+    load_regions(regions_file, pad, *targeted);
+    mapIn.reset(new istream(targeted.get()));
+  }
+
+  SamMappingSetGen mapGen(mapIn.get(), default_cnp, addSQToRefDict, &global::refDict, true);
+  mapGen.set_fields(SamMapping::load_seq | SamMapping::load_tags);
+  mapGen.set_pair_mates(drop_diff_chr);
+  OutputWriter out_writer;
+
+  long long next_chunk_in = 0;
+  PipelineTuner tuner(num_threads);
+  OrderedPipeline<Chunk> pipeline(tuner.max_threads(), 2 * tuner.max_threads());
+  pipeline.set_tuner(&tuner);
+
+  pipeline.run([&] (Chunk& chunk) {
+      // only pair raw records here; parsing happens in the workers
+      if (not mapGen.get_chunk(chunk.input, tuner.chunk_size()))
+	return false;
+      chunk.chunk_id = next_chunk_in++;
+      return true;
+    },
+    [&] (Chunk& chunk, int tid) {
+      double start = omp_get_wtime();
+      mapGen.parse_chunk(chunk.input, chunk.sets);
+      chunk.contigs.init(&global::refDict, false);
+      chunk.thread_id = tid;
+      chunk.out_str.clear();
+      chunk.err_str.str(string());
+      for (int i = 0; i < n_dests; ++i) chunk.n_pairs[i] = 0;
+      chunk.n_dummies = 0;
+
+      for (size_t i = 0; i < chunk.sets.size(); ++i) {
+	process_mapping_set(chunk.sets[i]->first, chunk.sets[i]->second, chunk);
+	delete chunk.sets[i];
+      }
+      chunk.work_seconds = omp_get_wtime() - start;
+    },
+    [&] (Chunk& chunk, int tid) {
+      tuner.chunk_done(chunk.sets.size(), chunk.input.n_bytes(), chunk.work_seconds);
+      out_writer.write(1, chunk.out_str);
+      for (int i = 0; i < n_dests; ++i) total_pairs[i] += chunk.n_pairs[i];
+      total_dummies += chunk.n_dummies;
+      if (global::verbosity > 0) {
+	cerr << "chunk=" << chunk.chunk_id << " work_thread=" << chunk.thread_id
+	     << " print_thread=" << tid << '\n';
+	cerr << chunk.err_str.str();
+	cerr.flush();
+      }
+    });
+  out_writer.close();
+
+  if (global::verbosity > 0) {
+    tuner.print_stats(clog);
+    if (targeted) targeted->print_stats(clog);
+    mapGen.print_stats(clog);
+    clog << "pairs: " << total_pairs[dest_remap] << " to remap, "
+	 << total_pairs[dest_keep] << " concordant, "
+	 << total_pairs[dest_drop] << " dropped; "
+	 << total_dummies << " dummy mates added\n";
+  }
+
+  return 0;
+}
@@ -1,6 +1,7 @@
 using namespace std;
 
 #include <cstdlib>
+#include <getopt.h>
 #include <iostream>
 #include <string>
 #include <map>
@@ -15,106 +16,123 @@ using namespace std;
 #include "SamMapping.hpp"
 #include "SamMappingSetGen.hpp"
 #include "common.hpp"
+#include "BamWriter.hpp"
+#include "FlagFilter.hpp"
+#include "OrderedPipeline.hpp"
+#include "PipelineTuner.hpp"
+#include "OutputWriter.hpp"
 
 
 int num_threads = 1;
 
-string (*cnp)(const string&);
+StrView (*cnp)(const StrView&);
 void (*fnp)(const string&, Clone&, int&);
 
-class Filter
+// an output file; each one has its own writer thread and queue, so a slow reader
+// on one destination does not hold up writes to the others until its queue fills up
+class Destination
 {
 public:
-  vector<unsigned long> must_have;
-  vector<unsigned long> must_not_have;
-  bool stop_on_hit;
-  string dest_file;
+  string name;
+  // NULL for /dev/null, whose records are counted and dropped
+  FILE * f;
+  OutputWriter * writer;
+  BgzfWriter * bam;
+  long long int n_records;
+  long long int n_bytes;
 };
 
-map<string,FILE *> file_map;
+vector<Destination> dest_vector;
+map<string,int> dest_id;
 vector<Filter> filter_vector;
+FilterTable filter_table;
 
+// write uncompressed BAM instead of SAM to every destination
+bool bam_output = false;
+string header_text;
+// with -r, text records are passed through as they were read; otherwise they are rebuilt
+// from the parsed fields, which normalizes non-canonical input
+bool pass_through = false;
+
+
+// clones going through the pipeline together; chunk objects are reused,
+// and so are the output streams of each destination, indexed by destination id
 class Chunk
 {
 public:
   long long int chunk_id;
   int thread_id;
-  map<string,stringstream*> out_str;
-  stringstream* err_str;
-};
-
-class ChunkComparator
-{
-public:
-  bool operator() (const Chunk& lhs, const Chunk& rhs) { return lhs.chunk_id > rhs.chunk_id; }
+  SamMappingChunk input;
+  double work_seconds;
+  vector<SamMappingSet*> sets;
+  vector<OutputBuffer*> out_str;
+  vector<long long int> n_records;
+  stringstream err_str;
+
+  Chunk() : out_str(dest_vector.size()), n_records(dest_vector.size(), 0) {
+    for (size_t i = 0; i < out_str.size(); ++i) out_str[i] = new OutputBuffer();
+  }
+  ~Chunk() {
+    for (size_t i = 0; i < out_str.size(); ++i) delete out_str[i];
+  }
 };
 
 
 void
 addSQToRefDict(const string& line)
 {
-  strtk::std_string::token_list_type token_list;
-  strtk::split("\t", line, back_inserter(token_list));
-  strtk::std_string::token_list_type::iterator itr = token_list.begin();
-
-  string s = string(itr->first, itr->second);
-  if (!s.compare("@SQ")) {
-    string contig_name = string();
-    long long int contig_len = 0;
-    while (contig_name.length() == 0 || contig_len == 0) {
-      ++itr;
-      if (itr == token_list.end()) {
-	cerr << "did not find contig name and len in @SQ line: " << line << endl;
-	exit(1);
-      }
-      s = string(itr->first, itr->second);
-      if (!s.substr(0, 2).compare("SN")) {
-	contig_name = s.substr(3);
-      } else if (!s.substr(0, 2).compare("LN")) {
-	contig_len = atoll(s.substr(3).c_str());
-      }
-    }
-    Contig* contig = &global::refDict[contig_name];
-    if (contig->name.length() == 0) {
-      //cerr << "error: missing sequence for contig [" << contig_name << "]";
-      //exit(1);
-      contig->name = contig_name;
-      contig->len = contig_len;
-      contig->idx = global::refDict.size() - 1;
-      if (global::verbosity > 0)
-	clog << "added contig [" << contig->name << "] of length [" << contig->len << "]\n";
-    } else {
-      cerr << "error: contig [" << contig->name << "] already exists!" << endl;
-      exit(1);
-    }
-  }
+  add_sq_line_to_dict(line, global::refDict);
   //cout << line << '\n';
+  if (bam_output) {
+    header_text += line;
+    header_text += '\n';
+  }
 }
 
 void
 print_sam_mapping(ostream& os, const SamMapping& m)
 {
-  os << m.name
+  if (bam_output) {
+    static thread_local string buf;
+    buf.clear();
+    append_bam_record(buf, m);
+    os.write(buf.data(), buf.size());
+    return;
+  }
+  if (pass_through) {
+    // records are not modified, so the input text is printed as is
+    os << m.line() << '\n';
+    return;
+  }
+  os << m.name()
      << '\t' << m.flags.to_ulong()
      << '\t' << (m.db != NULL? m.db->name : "*")
      << '\t' << m.dbPos
      << '\t' << m.mqv
-     << '\t' << m.cigar
-     << '\t' << (m.mp_db != NULL?
-		 (m.mp_db == m.db? "=" : m.mp_db->name) : "*")
+     << '\t' << m.cigar()
+     << '\t' << (m.mp_db != NULL? (m.mp_db == m.db? "=" : m.mp_db->name) : "*")
      << '\t' << m.mp_dbPos
      << '\t' << m.tLen
-     << '\t' << m.seq
-     << '\t' << m.qvString;
-  for (size_t j = 0; j < m.rest.size(); ++j) {
-    os << '\t' << m.rest[j].key << ':' << m.rest[j].type << ':' << m.rest[j].value;
+     << '\t' << m.seq()
+     << '\t' << m.qvString();
+  if (not m.tags().empty()) {
+    os << '\t' << m.tags();
   }
   os << '\n';
 }
 
 void
-process_mapping_set(const string& s, vector<SamMapping>& v,
-		    map<string,stringstream*>& out_str) //, ostream* err_str)
+route_mapping_set(const vector<SamMapping>& v, int dest, Chunk& chunk)
+{
+  chunk.n_records[dest] += v.size();
+  if (dest_vector[dest].f == NULL) return;
+  for (size_t i = 0; i < v.size(); ++i) {
+    print_sam_mapping(*chunk.out_str[dest], v[i]);
+  }
+}
+
+void
+process_mapping_set(const string& s, vector<SamMapping>& v, Chunk& chunk)
 {
   if ((global::rg_set.rg_list.size() == 0 and v.size() != 1)
       or (global::rg_set.rg_list.size() > 0 and v.size() != 2)) {
@@ -122,32 +140,19 @@ process_mapping_set(const string& s, vector<SamMapping>& v,
     exit(1);
   }
 
-  if (global::rg_set.rg_list.size() == 0) {
-    for (size_t i = 0; i < filter_vector.size(); ++i) {
-      Filter& f = filter_vector[i];
-      if (((v[0].flags.to_ulong() & f.must_have[0]) == f.must_have[0])
-	  && ((v[0].flags.to_ulong() & f.must_not_have[0]) == 0)) {
-	if (out_str.count(f.dest_file) == 0) {
-	  out_str[f.dest_file] = new stringstream();
-	}
-	print_sam_mapping(*(out_str[f.dest_file]), v[0]);
-	if (f.stop_on_hit) {
-	  break;
-	}
-      }
+  unsigned long flags[2];
+  for (size_t i = 0; i < v.size(); ++i) flags[i] = v[i].flags.to_ulong();
+
+  if (filter_table.compiled()) {
+    unsigned e = filter_table.index(flags);
+    for (const int* p = filter_table.entry_begin(e); p != filter_table.entry_end(e); ++p) {
+      route_mapping_set(v, filter_vector[*p].dest, chunk);
     }
   } else {
     for (size_t i = 0; i < filter_vector.size(); ++i) {
       Filter& f = filter_vector[i];
-      if (((v[0].flags.to_ulong() & f.must_have[0]) == f.must_have[0])
-	  && ((v[0].flags.to_ulong() & f.must_not_have[0]) == 0)
-	  && ((v[1].flags.to_ulong() & f.must_have[1]) == f.must_have[1])
-	  && ((v[1].flags.to_ulong() & f.must_not_have[1]) == 0)) {
-	if (out_str.count(f.dest_file) == 0) {
-	  out_str[f.dest_file] = new stringstream();
-	}
-	print_sam_mapping(*(out_str[f.dest_file]), v[0]);
-	print_sam_mapping(*(out_str[f.dest_file]), v[1]);
+      if (f.matches(flags)) {
+	route_mapping_set(v, f.dest, chunk);
 	if (f.stop_on_hit) {
 	  break;
 	}
@@ -156,97 +161,80 @@ process_mapping_set(const string& s, vector<SamMapping>& v,
   }
 }
 
-string
-default_cnp(const string& s)
+// hand the output of a chunk to the destination writers, in input order
+void
+write_output(Chunk& chunk)
+{
+  for (size_t i = 0; i < dest_vector.size(); ++i) {
+    Destination& d = dest_vector[i];
+    OutputBuffer& b = *chunk.out_str[i];
+    d.n_records += chunk.n_records[i];
+    d.n_bytes += b.size();
+    chunk.n_records[i] = 0;
+    if (b.size() == 0) continue;
+    if (bam_output) {
+      d.bam->write(b.data(), b.size());
+      b.clear();
+    } else {
+      d.writer->write(fileno(d.f), b);
+    }
+  }
+}
+
+int
+get_dest_id(const string& name)
 {
-  return string(s);
+  map<string,int>::iterator it = dest_id.find(name);
+  if (it != dest_id.end()) return it->second;
+
+  Destination d;
+  d.name = name;
+  d.f = NULL;
+  d.writer = NULL;
+  d.bam = NULL;
+  d.n_records = 0;
+  d.n_bytes = 0;
+  dest_vector.push_back(d);
+  dest_id[name] = dest_vector.size() - 1;
+  return dest_vector.size() - 1;
 }
 
 void
-parse_bitmask(const string& s, unsigned long& must_have, unsigned long& must_not_have)
+open_destination(Destination& d)
 {
-  must_have = 0;
-  must_not_have = 0;
-  size_t i = s.find('/');
-  string one_side = s.substr(0, i);
-  stringstream ss(one_side);
-  ss >> hex >> must_have;
-
-  if (i < s.npos) {
-    one_side = s.substr(i + 1);
-    ss.clear();
-    ss.str(one_side);
-    ss >> hex >> must_not_have;
+  const string& name = d.name;
+  if (name == "/dev/null") {
+    d.f = NULL;
+  } else if (name[0] == '&') {
+    int fd = atoi(name.substr(1).c_str());
+    if (fd == 1) {
+      d.f = stdout;
+    } else if (fd == 2) {
+      d.f = stderr;
+    } else {
+      d.f = fdopen(fd, "w");
+    }
+  } else {
+    d.f = fopen(name.c_str(), "w");
   }
-  if (must_have & must_not_have) {
-    cerr << "invalid bitmask: " << s << " (some bits are both set and unset)" << endl;
+  if (name != "/dev/null" and d.f == NULL) {
+    cerr << "error opening destination: " << name << endl;
     exit(1);
   }
 }
 
+StrView
+default_cnp(const StrView& s)
+{
+  return s;
+}
+
 void
 add_filter(const string& s)
 {
   Filter f;
-
-  size_t i = s.find(':');
-  if (i == s.npos) {
-    cerr << "invalid filter: " << s << endl;
-    exit(1);
-  }
-  string conditions = s.substr(0, i);
-  f.dest_file = s.substr(i + 1);
-
-  if (global::rg_set.rg_list.size() == 0) {
-    f.must_have = vector<unsigned long>(1);
-    f.must_not_have = vector<unsigned long>(1);
-
-    i = conditions.find(',');
-    string one_condition = conditions.substr(0, i);
-    parse_bitmask(one_condition, f.must_have[0], f.must_not_have[0]);
-    if (i == conditions.npos) {
-      f.stop_on_hit = true;
-    } else {
-      f.stop_on_hit = not(atoi(conditions.substr(i + 1).c_str()) == 0);
-    }
-  } else {
-    f.must_have = vector<unsigned long>(2);
-    f.must_not_have = vector<unsigned long>(2);
-
-    i = conditions.find(',');
-    if (i == conditions.npos) {
-      cerr << "invalid filter: " << s << endl;
-      exit(1);
-    }
-    string one_condition = conditions.substr(0, i);
-    parse_bitmask(one_condition, f.must_have[0], f.must_not_have[0]);
-
-    conditions = conditions.substr(i + 1);
-    i = conditions.find(',');
-    one_condition = conditions.substr(0, i);
-    parse_bitmask(one_condition, f.must_have[1], f.must_not_have[1]);
-
-    if (i == conditions.npos) {
-      f.stop_on_hit = true;
-    } else {
-      f.stop_on_hit = not(atoi(conditions.substr(i + 1).c_str()) == 0);      
-    }
-  }
-
-  if (file_map.count(f.dest_file) == 0) {
-    if (f.dest_file[0] == '&') {
-      int fd = atoi(f.dest_file.substr(1).c_str());
-      if (fd == 1) {
-	file_map[f.dest_file] = stdout;
-      } else if (fd == 2) {
-	file_map[f.dest_file] = stderr;
-      } else {
-	file_map[f.dest_file] = fdopen(fd, "w");
-      }
-    } else {
-      file_map[f.dest_file] = fopen(f.dest_file.c_str(), "w");
-    }
-  }
+  string dest_file = parse_filter(s, global::rg_set.rg_list.size() == 0? 1 : 2, f);
+  f.dest = get_dest_id(dest_file);
 
   filter_vector.push_back(f);
 
@@ -254,7 +242,7 @@ add_filter(const string& s)
     clog << "added filter: " << "0x" << hex << f.must_have[0] << "/" << "0x" << hex << f.must_not_have[0];
     if (global::rg_set.rg_list.size() > 0)
       clog << "," << "0x" << hex << f.must_have[1] << "/" << "0x" << hex << f.must_not_have[1];
-    clog << "," << f.stop_on_hit << ":" << f.dest_file << '\n';
+    clog << "," << f.stop_on_hit << ":" << dest_file << dec << '\n';
   }
 }
 
@@ -267,14 +255,20 @@ main(int argc, char* argv[])
   vector<string> filter_list;
   cnp = &default_cnp;
 
-  char c;
-  while ((c = getopt(argc, argv, "l:N:Pf:g:v")) != -1) {
+  bool explain = false;
+  static struct option long_options[] = {
+    {"explain", no_argument, NULL, 'x'},
+    {NULL, 0, NULL, 0}
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "l:N:Pf:Cg:vbrx", long_options, NULL)) != -1) {
     switch (c) {
     case 'l':
       pairing_file = optarg;
       break;
     case 'N':
-      num_threads = atoi(optarg);
+      num_threads = PipelineTuner::parse_num_threads(optarg);
       break;
     case 'P':
       cnp = cloneNameParser;
@@ -284,12 +278,25 @@ main(int argc, char* argv[])
       filter_list.push_back(string(optarg));
       //add_filter(optarg);
       break;
+    case 'C':
+      // the filters of filter-concordant, in place
+      filter_list.insert(filter_list.end(), concordant_filters, concordant_filters + n_concordant_filters);
+      break;
     case 'g':
       global::default_rg_name = optarg;
       break;
     case 'v':
       global::verbosity++;
       break;
+    case 'b':
+      bam_output = true;
+      break;
+    case 'r':
+      pass_through = true;
+      break;
+    case 'x':
+      explain = true;
+      break;
     default:
       cerr << "unrecognized option: " << c << endl;
       exit(1);
@@ -301,7 +308,8 @@ main(int argc, char* argv[])
     exit(1);
   }
 
-  if (global::verbosity > 0) clog << "number of threads: " << num_threads << '\n';
+  if (global::verbosity > 0)
+    clog << "number of threads: " << (num_threads > 0? to_string(num_threads) : "auto") << '\n';
 
   if (pairing_file.size() > 0) {
     igzstream pairingIn(pairing_file);
@@ -315,118 +323,111 @@ main(int argc, char* argv[])
   for (size_t i = 0; i < filter_list.size(); ++i) {
     add_filter(filter_list[i]);
   }
+  filter_table.compile(filter_vector, global::rg_set.rg_list.size() == 0? 1 : 2);
+  if (explain) {
+    vector<string> dest_name;
+    for (size_t i = 0; i < dest_vector.size(); ++i) dest_name.push_back(dest_vector[i].name);
+    filter_table.explain(cout, filter_vector, dest_name);
+    return 0;
+  }
+  for (size_t i = 0; i < dest_vector.size(); ++i) {
+    open_destination(dest_vector[i]);
+  }
 
-  igzstream mapIn(optind < argc? argv[optind] : "-");
+  // gzip and BGZF input is inflated by the mapping reader
+  igzstream mapIn(optind < argc? argv[optind] : "-", false);
   if (!mapIn) {
     cerr << "error opening mappings file: " << argv[optind] << endl;
     exit(1);
   }
 
   SamMappingSetGen mapGen(&mapIn, cnp, addSQToRefDict, &global::refDict, true);
-  pair<string,vector<SamMapping> >* m = mapGen.get_next();
+  // only flags and read names are looked at, and the rest is printed back
+  mapGen.set_fields(bam_output? SamMapping::load_copy
+		    : pass_through? SamMapping::load_line : SamMapping::load_seq | SamMapping::load_tags);
+  SamMappingSet* m = mapGen.get_next();
+  string bam_header;
+  if (bam_output) append_bam_header(bam_header, header_text, global::refDict);
+  for (size_t i = 0; i < dest_vector.size(); ++i) {
+    Destination& d = dest_vector[i];
+    if (d.f == NULL) continue;
+    d.writer = new OutputWriter();
+    if (bam_output) {
+      d.bam = new BgzfWriter(d.writer, fileno(d.f));
+      d.bam->write(bam_header);
+    }
+  }
   if (m != NULL) {
-    map<string,stringstream*> out_str;
-    //process_mapping_set(m->first, m->second, out_str, &cerr);
-    process_mapping_set(m->first, m->second, out_str);
-    for (map<string,stringstream*>::iterator it = out_str.begin();
-	 it != out_str.end(); ++it) {
-      fputs(it->second->str().c_str(), file_map[it->first]);
-      delete it->second;
+    {
+      Chunk first;
+      process_mapping_set(m->first, m->second, first);
+      write_output(first);
     }
-
     delete m;
 
-    priority_queue<Chunk,vector<Chunk>,ChunkComparator> h;
     long long next_chunk_in = 0;
-    long long next_chunk_out = 0;
-    int chunk_size = 1000;
-
-    //omp_lock_t input_lock;
-    //omp_init_lock(&input_lock);
-#pragma omp parallel num_threads(num_threads)
-    {
-      int tid = omp_get_thread_num();
-      pair<string,vector<SamMapping> >* local_m;
-      vector<pair<string,vector<SamMapping> >* > local_m_vector(chunk_size);
-      int load;
-      while (true) {
-	Chunk chunk;
-	//chunk.chunk_id = i;
+    PipelineTuner tuner(num_threads);
+    OrderedPipeline<Chunk> pipeline(tuner.max_threads(), 2 * tuner.max_threads());
+    pipeline.set_tuner(&tuner);
+
+    pipeline.run([&] (Chunk& chunk) {
+	// only group raw records by clone here; parsing happens in the workers
+	if (not mapGen.get_chunk(chunk.input, tuner.chunk_size()))
+	  return false;
+	chunk.chunk_id = next_chunk_in++;
+	return true;
+      },
+      [&] (Chunk& chunk, int tid) {
+	double start = omp_get_wtime();
+	mapGen.parse_chunk(chunk.input, chunk.sets);
 	chunk.thread_id = tid;
-
-#pragma omp critical(input)
-	{
-	  //omp_set_lock(&input_lock);
-	  for (load = 0; load < chunk_size; ++load) {
-	    local_m = mapGen.get_next();
-	    if (local_m == NULL) {
-	      break;
-	    }
-	    local_m_vector[load] = local_m;
-	  }
-
-	  chunk.chunk_id = next_chunk_in;
-	  if (load > 0)
-	    ++next_chunk_in;
-	  //omp_unset_lock(&input_lock);
+	for (size_t i = 0; i < chunk.out_str.size(); ++i)
+	  chunk.out_str[i]->clear();
+	chunk.err_str.str(string());
+	if (global::verbosity > 0) {
+	  chunk.err_str << "tid=" << tid << " chunk_id=" << chunk.chunk_id
+			<< " start:" << chunk.sets.front()->first
+			<< " end:" << chunk.sets.back()->first
+			<< '\n';
 	}
 
-	if (load == 0)
-	  break;
-
-	//chunk.out_str = new stringstream();
-	chunk.err_str = new stringstream();
-	*chunk.err_str << "tid=" << tid << " chunk_id=" << chunk.chunk_id
-		       << " start:" << local_m_vector[0]->first
-		       << " end:" << local_m_vector[load - 1]->first
-		       << '\n';
-
-	for (int i = 0; i < load; ++i) {
-	  process_mapping_set(local_m_vector[i]->first, local_m_vector[i]->second,
-			      chunk.out_str);
-	  //#ifdef NDEBUG
-	  //		    NULL
-	  //#else
-	  //		    chunk.err_str
-	  //#endif
-	  //		    );
-	  delete local_m_vector[i];
+	for (size_t i = 0; i < chunk.sets.size(); ++i) {
+	  process_mapping_set(chunk.sets[i]->first, chunk.sets[i]->second, chunk);
+	  delete chunk.sets[i];
 	}
-
-#pragma omp critical(output)
-	{
-	  h.push(chunk);
-	  while (h.size() > 0) {
-	    chunk = h.top();
-	    assert(chunk.chunk_id >= next_chunk_out);
-	    if (chunk.chunk_id > next_chunk_out) {
-	      break;
-	    }
-
-	    for (map<string,stringstream*>::iterator it = chunk.out_str.begin();
-		 it != chunk.out_str.end(); ++it) {
-	      fputs(it->second->str().c_str(), file_map[it->first]);
-	      delete it->second;
-	    }
-
-	    if (global::verbosity > 0) {
-	      cerr << "chunk=" << chunk.chunk_id << " work_thread=" << chunk.thread_id
-		   << " print_thread=" << tid << '\n';
-	      cerr << chunk.err_str->str();
-	      cerr.flush();
-	    }
-	    delete chunk.err_str;
-	    h.pop();
-	    ++next_chunk_out;
-	  }
+	chunk.work_seconds = omp_get_wtime() - start;
+      },
+      [&] (Chunk& chunk, int tid) {
+	tuner.chunk_done(chunk.sets.size(), chunk.input.n_bytes(), chunk.work_seconds);
+	write_output(chunk);
+	if (global::verbosity > 0) {
+	  cerr << "chunk=" << chunk.chunk_id << " work_thread=" << chunk.thread_id
+	       << " print_thread=" << tid << '\n';
+	  cerr << chunk.err_str.str();
+	  cerr.flush();
 	}
-      }
+      });
+    if (global::verbosity > 0) tuner.print_stats(clog);
+  }
+
+  for (size_t i = 0; i < dest_vector.size(); ++i) {
+    Destination& d = dest_vector[i];
+    if (d.f == NULL) continue;
+    if (d.bam != NULL) {
+      d.bam->close();
+      delete d.bam;
     }
-    //omp_destroy_lock(&input_lock);
+    d.writer->close();
+    delete d.writer;
+    fclose(d.f);
+  }
 
-    for (map<string,FILE*>::iterator it = file_map.begin();
-	 it != file_map.end(); ++it) {
-      fclose(it->second);
+  if (global::verbosity > 0) {
+    mapGen.print_stats(clog);
+    for (size_t i = 0; i < dest_vector.size(); ++i) {
+      clog << dec << "destination " << i << " [" << dest_vector[i].name << "]: "
+	   << dest_vector[i].n_records << " records, "
+	   << dest_vector[i].n_bytes << " bytes\n";
     }
   }
 
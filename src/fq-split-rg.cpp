@@ -0,0 +1,419 @@
+using namespace std;
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <omp.h>
+#include <unistd.h>
+
+#include "igzstream.hpp"
+#include "globals.hpp"
+#include "BlockLineReader.hpp"
+#include "BamWriter.hpp"
+#include "OrderedPipeline.hpp"
+#include "PipelineTuner.hpp"
+#include "OutputWriter.hpp"
+
+// the end of stage 2 of getype: split reads renamed by fq-trim-pairs into one FASTQ file
+// per read group and mate, <prefix><rg>.<nip><suffix>, compressed as BGZF (which gunzip
+// and zc read as plain gzip); batches of reads of any output are compressed in parallel
+// by one pool of threads, and written out in input order; with -F, the plain FASTQ of
+// each output also goes to the FIFO <fifo_prefix><rg>.<nip>, read by a concurrent mapper,
+// and the compressed files, if kept, serve to resume
+
+
+enum { fq_format, tfq_format };
+
+int in_format = -1;
+int level = 6;
+string prefix;
+string suffix = ".fq.gz";
+bool use_rg_names = false;
+string fifo_prefix;
+bool use_fifos = false;
+bool use_files = true;
+// raw input gathered per output before it is handed to the pool; smaller when a mapper
+// is waiting for it at the other end of a FIFO
+size_t batch_size = 16 * BgzfCompressor::max_block_data;
+
+class Output
+{
+public:
+  string name;
+  int fd;
+  string fifo_name;
+  int fifo_fd;
+  // each FIFO is written by its own thread: a mapper reading both mates of a read group
+  // in step must never wait on another output
+  unique_ptr<OutputWriter> fifo_writer;
+  // the output of the other mate of the same read group, if opened
+  int mate;
+  // input lines not yet handed to the pool
+  string pending;
+  long long int n_reads;
+  long long int n_bytes;
+  long long int n_compressed_bytes;
+
+  Output() : fd(-1), fifo_fd(-1), mate(-1), n_reads(0), n_bytes(0), n_compressed_bytes(0) {}
+};
+
+vector<Output> output_vector;
+// output id of each <rg_num_id>.<nip> key
+unordered_map<string,int> output_id;
+
+// a batch of reads of one output going through the pipeline; chunk objects are reused
+class Chunk
+{
+public:
+  long long int chunk_id;
+  int output;
+  string input;
+  // size of the FASTQ before compression
+  size_t n_bytes;
+  double work_seconds;
+  string fq;
+  string out;
+  BgzfCompressor compressor;
+
+  Chunk() : compressor(level) {}
+};
+
+
+// open the output of read group rg_num_id, mate nip
+int
+add_output(const string& rg_num_id, const string& nip)
+{
+  string key = rg_num_id + "." + nip;
+  string rg = rg_num_id;
+  if (use_rg_names) {
+    ReadGroup * rg_p = global::rg_set.find_by_num_id(rg);
+    if (rg_p == NULL) {
+      cerr << "error: read group with id [" << rg << "] not in pairing file" << endl;
+      exit(1);
+    }
+    rg = rg_p->get_names()[0];
+  }
+  Output o;
+  if (use_files) {
+    o.name = prefix + rg + "." + nip + suffix;
+    o.fd = open(o.name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (o.fd < 0) {
+      cerr << "error opening output file [" << o.name << "]: " << strerror(errno) << endl;
+      exit(1);
+    }
+  }
+  if (use_fifos) {
+    // this waits for the reader to open the other end; mappers open mate 1, then mate 2,
+    // the order in which they are created here
+    o.fifo_name = fifo_prefix + rg + "." + nip;
+    o.fifo_fd = open(o.fifo_name.c_str(), O_WRONLY);
+    if (o.fifo_fd < 0) {
+      cerr << "error opening FIFO [" << o.fifo_name << "]: " << strerror(errno) << endl;
+      exit(1);
+    }
+    o.fifo_writer.reset(new OutputWriter(4));
+  }
+  if (global::verbosity > 0)
+    clog << "new key:[" << key << "] file:[" << o.name << "] fifo:[" << o.fifo_name << "]\n";
+  output_vector.push_back(move(o));
+  int i = output_vector.size() - 1;
+  output_id[key] = i;
+  unordered_map<string,int>::iterator it = output_id.find(rg_num_id + "." + (nip == "1"? "2" : "1"));
+  if (it != output_id.end()) {
+    output_vector[i].mate = it->second;
+    output_vector[it->second].mate = i;
+  }
+  return i;
+}
+
+// the output of a read named <rg_num_id>:<pair_no>:<nip>:...
+int
+get_output_id(const StrView& name, string& key)
+{
+  size_t p1 = name.find(':');
+  size_t p2 = (p1 != StrView::npos? name.find(':', p1 + 1) : StrView::npos);
+  size_t p3 = (p2 != StrView::npos? name.find(':', p2 + 1) : StrView::npos);
+  if (p3 == StrView::npos) {
+    cerr << "error: read name not of the form <rg>:<pair_no>:<nip>:... [" << name << "]" << endl;
+    exit(1);
+  }
+  key.assign(name.data(), p1);
+  key += '.';
+  key.append(name.data() + p2 + 1, p3 - p2 - 1);
+  unordered_map<string,int>::iterator it = output_id.find(key);
+  if (it != output_id.end()) return it->second;
+  return add_output(key.substr(0, p1), key.substr(p1 + 1));
+}
+
+// hand the pending lines of output i over to the chunk
+void
+take_pending(int i, Chunk& chunk)
+{
+  chunk.output = i;
+  chunk.input.clear();
+  chunk.input.swap(output_vector[i].pending);
+}
+
+// gather input lines by output until one has a full batch; at the end of input,
+// hand over the rest, one output at a time; false when nothing is left;
+// with FIFOs, a mapper reads both mates of a read group in step, so the two outputs
+// are cut together, at a pair boundary, and handed over one after the other: a write
+// blocked on one FIFO then never holds back data the mapper needs from the other
+bool
+read_chunk(BlockLineReader& reader, Chunk& chunk)
+{
+  static string key;
+  static size_t next_flush = 0;
+  static int next_mate = -1;
+  StrView line;
+  if (next_mate >= 0) {
+    take_pending(next_mate, chunk);
+    next_mate = -1;
+    return true;
+  }
+  while (reader.get_line(line)) {
+    if (in_format < 0) {
+      in_format = (line.find('\t') != StrView::npos? tfq_format : fq_format);
+    }
+    if (in_format == fq_format and (line.size() == 0 or line[0] != '@')) {
+      cerr << "read name does not start with '@' [" << line << "]" << endl;
+      exit(1);
+    }
+    StrView name = line.substr(in_format == fq_format? 1 : 0);
+    size_t tab = name.find('\t');
+    if (tab != StrView::npos) name = name.substr(0, tab);
+    int i = get_output_id(name, key);
+    Output& o = output_vector[i];
+    for (int k = 0; k < (in_format == fq_format? 4 : 1); ++k) {
+      if (k > 0 and not reader.get_line(line)) {
+	cerr << "error: input ends within a read" << endl;
+	exit(1);
+      }
+      o.pending.append(line.data(), line.size());
+      o.pending += '\n';
+    }
+    ++o.n_reads;
+    if (not use_fifos or o.mate < 0) {
+      if (o.pending.size() >= batch_size) {
+	take_pending(i, chunk);
+	return true;
+      }
+    } else {
+      Output& m = output_vector[o.mate];
+      if (m.n_reads == o.n_reads and max(o.pending.size(), m.pending.size()) >= batch_size) {
+	// mate 1 first
+	int j = o.mate;
+	if (j < i) swap(i, j);
+	take_pending(i, chunk);
+	if (output_vector[j].pending.size() > 0) next_mate = j;
+	return true;
+      }
+    }
+  }
+  while (next_flush < output_vector.size()) {
+    int i = next_flush++;
+    if (output_vector[i].pending.size() > 0) {
+      take_pending(i, chunk);
+      int j = output_vector[i].mate;
+      if (use_fifos and j >= 0 and output_vector[j].pending.size() > 0)
+	next_mate = j;
+      return true;
+    }
+  }
+  return false;
+}
+
+// tfq lines <name> <seq> <comment> <qual> to FASTQ
+void
+tfq_to_fq(const string& in, string& out)
+{
+  out.clear();
+  size_t start = 0;
+  while (start < in.size()) {
+    size_t end = in.find('\n', start);
+    size_t f[5];
+    f[0] = start;
+    int n = 1;
+    for (size_t j = start; j < end and n < 5; ++j)
+      if (in[j] == '\t') f[n++] = j + 1;
+    if (n != 4) {
+      cerr << "read entry [" << in.substr(start, end - start) << "] does not contain 4 fields!" << endl;
+      exit(1);
+    }
+    f[4] = end + 1;
+    out += '@';
+    out.append(in, f[0], f[1] - f[0] - 1);
+    out += '\n';
+    out.append(in, f[1], f[2] - f[1] - 1);
+    out += "\n+";
+    out.append(in, f[2], f[3] - f[2] - 1);
+    out += '\n';
+    out.append(in, f[3], f[4] - f[3]);
+    start = end + 1;
+  }
+}
+
+
+int
+main(int argc, char* argv[])
+{
+  string progName(argv[0]);
+  string pairing_file;
+
+  char c;
+  while ((c = getopt(argc, argv, "l:p:s:c:F:xN:v")) != -1) {
+    switch (c) {
+    case 'l':
+      pairing_file = optarg;
+      use_rg_names = true;
+      break;
+    case 'p':
+      prefix = optarg;
+      break;
+    case 's':
+      suffix = optarg;
+      break;
+    case 'c':
+      level = atoi(optarg);
+      if (level < 0 or level > 9) {
+	cerr << "invalid compression level: " << optarg << endl;
+	exit(1);
+      }
+      break;
+    case 'F':
+      fifo_prefix = optarg;
+      use_fifos = true;
+      break;
+    case 'x':
+      use_files = false;
+      break;
+    case 'N':
+      global::num_threads = PipelineTuner::parse_num_threads(optarg);
+      break;
+    case 'v':
+      global::verbosity++;
+      break;
+    default:
+      cerr << "unrecognized option: " << c << endl;
+      exit(1);
+    }
+  }
+
+  if (optind + 1 < argc or (not use_files and not use_fifos)) {
+    cerr << "use: " << argv[0] << " [-l <pairing_file>] [-p <prefix>] [-s <suffix>] [-c <level>]"
+	 << " [-F <fifo_prefix> [-x]] [-N <threads>] [<reads>]" << endl;
+    exit(1);
+  }
+  if (use_fifos)
+    batch_size = 4 * BgzfCompressor::max_block_data;
+
+  if (global::verbosity > 0)
+    clog << "number of threads: " << (global::num_threads > 0? to_string(global::num_threads) : "auto") << '\n';
+
+  if (use_rg_names) {
+    igzstream pairingIn(pairing_file);
+    if (!pairingIn) {
+      cerr << "error opening pairing file: " << pairing_file << "\n";
+      exit(1);
+    }
+    global::rg_set.load(pairingIn);
+    // every read group gets both outputs, even without reads, so that stage 3 finds
+    // all its files and every mapper sees the end of its input
+    for (size_t i = 0; i < global::rg_set.rg_list.size(); ++i) {
+      add_output(global::rg_set.rg_list[i].get_num_id(), "1");
+      add_output(global::rg_set.rg_list[i].get_num_id(), "2");
+    }
+  }
+
+  // gzip input is inflated by the line reader
+  igzstream in(optind < argc? argv[optind] : "-", false);
+  if (!in) {
+    cerr << "error opening reads file: " << argv[optind] << endl;
+    exit(1);
+  }
+  BlockLineReader reader(&in);
+  OutputWriter out_writer;
+
+  long long next_chunk_in = 0;
+  PipelineTuner tuner(global::num_threads);
+  OrderedPipeline<Chunk> pipeline(tuner.max_threads(), 2 * tuner.max_threads());
+  pipeline.set_tuner(&tuner);
+
+  pipeline.run([&] (Chunk& chunk) {
+      if (not read_chunk(reader, chunk))
+	return false;
+      chunk.chunk_id = next_chunk_in++;
+      return true;
+    },
+    [&] (Chunk& chunk, int) {
+      double start = omp_get_wtime();
+      const string * data = &chunk.input;
+      if (in_format == tfq_format) {
+	tfq_to_fq(chunk.input, chunk.fq);
+	data = &chunk.fq;
+      }
+      chunk.out.clear();
+      if (use_files)
+	chunk.compressor.append(chunk.out, data->data(), data->size());
+      chunk.n_bytes = data->size();
+      chunk.work_seconds = omp_get_wtime() - start;
+    },
+    [&] (Chunk& chunk, int) {
+      // batches have a fixed size; the tuner only picks the number of threads
+      tuner.chunk_done(1, chunk.input.size(), chunk.work_seconds);
+      Output& o = output_vector[chunk.output];
+      o.n_bytes += chunk.n_bytes;
+      if (use_files) {
+	o.n_compressed_bytes += chunk.out.size();
+	out_writer.write(o.fd, chunk.out);
+      }
+      if (use_fifos)
+	o.fifo_writer->write(o.fifo_fd, in_format == tfq_format? chunk.fq : chunk.input);
+    });
+
+  // each file ends with the empty block
+  if (use_files) {
+    BgzfCompressor compressor(level);
+    for (size_t i = 0; i < output_vector.size(); ++i) {
+      string eof_block;
+      compressor.append_block(eof_block, NULL, 0);
+      output_vector[i].n_compressed_bytes += eof_block.size();
+      out_writer.write(output_vector[i].fd, eof_block);
+    }
+  }
+  out_writer.close();
+  for (size_t i = 0; i < output_vector.size(); ++i) {
+    if (use_files and close(output_vector[i].fd) != 0) {
+      cerr << "error closing output file [" << output_vector[i].name << "]: " << strerror(errno) << endl;
+      exit(1);
+    }
+  }
+  // the FIFOs are closed last: a mapper done with its input then finishes after its
+  // compressed copy, which keeps the copy older than the mappings when resuming
+  for (size_t i = 0; use_fifos and i < output_vector.size(); ++i) {
+    output_vector[i].fifo_writer->close();
+    if (close(output_vector[i].fifo_fd) != 0) {
+      cerr << "error closing FIFO [" << output_vector[i].fifo_name << "]: " << strerror(errno) << endl;
+      exit(1);
+    }
+  }
+
+  if (global::verbosity > 0) {
+    tuner.print_stats(clog);
+    print_read_stats(clog, "lines", reader.n_lines(), reader.n_bytes(), reader.seconds());
+    for (size_t i = 0; i < output_vector.size(); ++i) {
+      const Output& o = output_vector[i];
+      clog << "output " << i << " [" << (use_files? o.name : o.fifo_name) << "]: " << o.n_reads << " reads, "
+	   << o.n_bytes << " bytes, " << o.n_compressed_bytes << " compressed\n";
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,640 @@
+using namespace std;
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <omp.h>
+
+#include "igzstream.hpp"
+#include "globals.hpp"
+#include "BlockLineReader.hpp"
+#include "OrderedPipeline.hpp"
+#include "PipelineTuner.hpp"
+#include "OutputWriter.hpp"
+#include "KmerFilter.hpp"
+
+// the read preparation of stage 2 of getype in one pass over paired reads, replacing
+// fq-trim-illumina-reads | fq-remove-short-paired-reads | fq-rename-paired-reads-with-len:
+// convert qualities to phred+33, trim quality tails of mqv 0 and 2 and poly-X tails,
+// drop short pairs, and rename reads <comment>:<pair_no>:<nip>:<len1>:<len2>:0:0:<name>;
+// with -k, also drop pairs where neither read has min_kmer_hits k-mers of the library;
+// with -d, collapse pairs of the same read group with the same sequences into the first
+// one, whose pair number becomes <pair_no>x<multiplicity>; the distinct pairs are kept
+// in memory and written at the end of input, so nothing is output before that
+
+
+enum { fq_format, tfq_format, sfq_format };
+const char * format_name[] = { "fq", "tfq", "sfq" };
+
+const int output_phred = 33;
+int input_phred = 0;
+int in_format = -1;
+int out_format = -1;
+int min_len_either = 0;
+int min_len_each = 0;
+int min_len_sum = 0;
+// poly-X tails at least this long are cut down to this length
+const int polyx_len = 10;
+const int pair_no_width = 10;
+KmerFilter kmer_filter;
+bool use_kmer_filter = false;
+int min_kmer_hits = 2;
+bool collapse = false;
+// with -d, the distinct pairs are written in buffers of this size
+const size_t write_size = 1u << 20;
+
+// pairs going through the pipeline together; chunk objects are reused
+// 128-bit hash of the read group and sequences of a pair; equal keys are still checked
+// against the pair text, so a collision only costs that check
+class PairKey
+{
+public:
+  uint64_t h[2];
+
+  PairKey() { h[0] = 0; h[1] = 0x9e3779b97f4a7c15ull; }
+  bool operator == (const PairKey& rhs) const { return h[0] == rhs.h[0] and h[1] == rhs.h[1]; }
+
+  void add(const StrView& s) {
+    size_t i = 0;
+    for (; i + 8 <= s.size(); i += 8) add_word(get_word(s.data() + i, 8));
+    add_word(get_word(s.data() + i, s.size() - i));
+    // the length ends each field, so that fields cannot run into each other
+    add_word(s.size());
+  }
+
+private:
+  static uint64_t get_word(const char * p, size_t n) {
+    uint64_t w = 0;
+    memcpy(&w, p, n);
+    return w;
+  }
+  // the finalizer of splitmix64
+  static uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+  void add_word(uint64_t w) {
+    h[0] = mix64(h[0] ^ w);
+    h[1] = mix64((h[1] + w) * 0xff51afd7ed558ccdull);
+  }
+};
+
+class PairKeyHash
+{
+public:
+  size_t operator () (const PairKey& k) const { return k.h[0]; }
+};
+
+class Chunk
+{
+public:
+  long long int chunk_id;
+  int thread_id;
+  // input lines of the pairs, each ending in a newline; line_start has one extra entry
+  string input;
+  vector<size_t> line_start;
+  int n_pairs;
+  double work_seconds;
+  // converted qualities of the two reads of the current pair
+  string qual[2];
+  string out;
+  // offsets in out of the pair numbers, filled in when output order is known
+  vector<size_t> pair_no_pos;
+  // with -d: start in out of each pair, and key of its read group and sequences
+  vector<size_t> pair_start;
+  vector<PairKey> pair_key;
+  long long int n_short;
+  long long int n_no_kmer_hits;
+  long long int n_qual_trimmed;
+  long long int n_polyx_trimmed;
+};
+
+long long int next_pair_no = 0;
+long long int total_pairs = 0;
+long long int total_short = 0;
+long long int total_no_kmer_hits = 0;
+long long int total_qual_trimmed = 0;
+long long int total_polyx_trimmed = 0;
+
+// with -d: the distinct pairs, in input order, with placeholders for the pair numbers
+class Fragments
+{
+public:
+  string text;
+  vector<size_t> start;
+  vector<size_t> pair_no_pos;
+  vector<long long int> multiplicity;
+  // index of each pair by read group and sequences; pairs with equal keys are told apart
+  // by their text
+  unordered_multimap<PairKey,size_t,PairKeyHash> index;
+};
+Fragments fragments;
+
+
+int
+detect_format(const StrView& line)
+{
+  const char * tab = (const char *)memchr(line.data(), '\t', line.size());
+  if (tab == NULL) {
+    if (line.size() > 0 and line[0] == '@') return fq_format;
+    cerr << "could not detect input format! [" << line << "]" << endl;
+    exit(1);
+  }
+  if (line.end() - tab >= 3 and tab[1] == 'z' and tab[2] == 's') return sfq_format;
+  return tfq_format;
+}
+
+// as detect_phred of lib.alu-detect.awk: the offset under which all qualities are in [-5,45]
+int
+detect_phred(const StrView& qual)
+{
+  static const int offset[] = { 33, 64 };
+  int res = 0;
+  for (int i = 0; i < 2; ++i) {
+    size_t j = 0;
+    while (j < qual.size() and qual[j] - offset[i] >= -5 and qual[j] - offset[i] <= 45) ++j;
+    if (j < qual.size()) continue;
+    if (res != 0) {
+      cerr << "could not detect phred: " << res << " and " << offset[i] << " are both possible" << endl;
+      exit(1);
+    }
+    res = offset[i];
+  }
+  if (res == 0) {
+    cerr << "could not detect phred from [" << qual << "]" << endl;
+    exit(1);
+  }
+  clog << "autodetected phred [" << res << "]\n";
+  return res;
+}
+
+// the fields of one read: name and comment without their '@' and '+'
+class FqRead
+{
+public:
+  StrView name;
+  StrView seq;
+  StrView comment;
+  StrView qual;
+};
+
+StrView
+chunk_line(const Chunk& chunk, size_t i)
+{
+  return StrView(chunk.input.data() + chunk.line_start[i],
+		 chunk.line_start[i + 1] - chunk.line_start[i] - 1);
+}
+
+void
+parse_read(const Chunk& chunk, size_t i, FqRead& r)
+{
+  if (in_format == fq_format) {
+    StrView l[4];
+    for (int k = 0; k < 4; ++k) l[k] = chunk_line(chunk, i + k);
+    if (l[0].size() == 0 or l[0][0] != '@') {
+      cerr << "read name does not start with '@' [" << l[0] << "]" << endl;
+      exit(1);
+    }
+    if (l[2].size() == 0 or l[2][0] != '+') {
+      cerr << "comment does not start with '+' [" << l[0] << ":" << l[2] << "]" << endl;
+      exit(1);
+    }
+    r.name = l[0].substr(1);
+    r.seq = l[1];
+    r.comment = l[2].substr(1);
+    r.qual = l[3];
+  } else {
+    StrView l = chunk_line(chunk, i);
+    StrView f[4];
+    size_t start = 0;
+    int n = 0;
+    for (size_t j = 0; j <= l.size(); ++j) {
+      if (j == l.size() or l[j] == '\t') {
+	if (n == 4) { n = 5; break; }
+	f[n++] = l.substr(start, j - start);
+	start = j + 1;
+      }
+    }
+    if (n != 4) {
+      cerr << "read entry [" << l << "] does not contain 4 fields!" << endl;
+      exit(1);
+    }
+    // sfq fields carry SAM-like tags: zs:Z:, zc:Z:, zq:Z:
+    for (int k = 1; in_format == sfq_format and k < 4; ++k) f[k] = f[k].substr(min<size_t>(5, f[k].size()));
+    r.name = f[0];
+    r.seq = f[1];
+    r.comment = f[2];
+    r.qual = f[3];
+  }
+  if (r.seq.size() != r.qual.size()) {
+    cerr << "read [" << r.name << "] has sequence and qualities of different lengths" << endl;
+    exit(1);
+  }
+}
+
+// convert qualities to output phred into q, then trim; returns the length to keep
+size_t
+trim_read(const FqRead& r, string& q, Chunk& chunk)
+{
+  size_t len = r.qual.size();
+  q.resize(len);
+  const char * src = r.qual.data();
+  char * dst = &q[0];
+  // a flat loop the compiler vectorizes
+  char delta = char(output_phred - input_phred);
+  for (size_t j = 0; j < len; ++j) dst[j] = char(src[j] + delta);
+
+  // quality tail of mqv 0 or 2
+  static const char mqv_0 = output_phred;
+  static const char mqv_2 = output_phred + 2;
+  while (len > 0 and (q[len - 1] == mqv_0 or q[len - 1] == mqv_2)) --len;
+  if (len < r.qual.size()) ++chunk.n_qual_trimmed;
+
+  // poly-X tail, cut down to polyx_len bases
+  if (len > 0) {
+    char c = r.seq[len - 1];
+    if (c == 'A' or c == 'C' or c == 'G' or c == 'T') {
+      size_t run = 1;
+      while (run < len and r.seq[len - 1 - run] == c) ++run;
+      if (run > (size_t)polyx_len) {
+	len -= run - polyx_len;
+	++chunk.n_polyx_trimmed;
+      }
+    }
+  }
+  return len;
+}
+
+void
+put_field(string& out, const StrView& s, const char * sfq_tag)
+{
+  if (out_format == sfq_format) out += sfq_tag;
+  out.append(s.data(), s.size());
+}
+
+void
+put_read(Chunk& chunk, const FqRead& r, int nip, const StrView& seq, const StrView& qual,
+	 size_t len1, size_t len2)
+{
+  string& out = chunk.out;
+  // name without any /1 or /2 suffix
+  StrView name = r.name;
+  if (name.size() >= 2 and name[name.size() - 2] == '/'
+      and (name[name.size() - 1] == '1' or name[name.size() - 1] == '2'))
+    name = name.substr(0, name.size() - 2);
+
+  if (out_format == fq_format) out += '@';
+  out.append(r.comment.data(), r.comment.size());
+  out += ':';
+  chunk.pair_no_pos.push_back(out.size());
+  out.append(pair_no_width, '0');
+  out += ':';
+  out += to_string(nip);
+  out += ':';
+  out += to_string(len1);
+  out += ':';
+  out += to_string(len2);
+  out += ":0:0:";
+  out.append(name.data(), name.size());
+  char sep = (out_format == fq_format? '\n' : '\t');
+  out += sep;
+  put_field(out, seq, "zs:Z:");
+  out += sep;
+  if (out_format == fq_format) out += '+';
+  else if (out_format == sfq_format) out += "zc:Z:";
+  out += sep;
+  put_field(out, qual, "zq:Z:");
+  out += '\n';
+}
+
+void
+process_pair(Chunk& chunk, size_t i)
+{
+  FqRead r[2];
+  size_t len[2];
+  StrView seq[2];
+  StrView qual[2];
+  size_t lines_per_read = (in_format == fq_format? 4 : 1);
+  for (int m = 0; m < 2; ++m) {
+    parse_read(chunk, i + m * lines_per_read, r[m]);
+    len[m] = trim_read(r[m], chunk.qual[m], chunk);
+    seq[m] = r[m].seq.substr(0, len[m]);
+    qual[m] = StrView(chunk.qual[m].data(), len[m]);
+    if (len[m] == 0) {
+      static const char mqv_0 = output_phred;
+      seq[m] = StrView("N", 1);
+      qual[m] = StrView(&mqv_0, 1);
+    }
+  }
+  size_t l0 = seq[0].size();
+  size_t l1 = seq[1].size();
+  if ((min_len_either > 0 and l0 < (size_t)min_len_either and l1 < (size_t)min_len_either)
+      or (min_len_each > 0 and (l0 < (size_t)min_len_each or l1 < (size_t)min_len_each))
+      or (min_len_sum > 0 and l0 + l1 < (size_t)min_len_sum)) {
+    ++chunk.n_short;
+    return;
+  }
+  if (use_kmer_filter
+      and kmer_filter.count_hits(seq[0].data(), l0, min_kmer_hits) < min_kmer_hits
+      and kmer_filter.count_hits(seq[1].data(), l1, min_kmer_hits) < min_kmer_hits) {
+    ++chunk.n_no_kmer_hits;
+    return;
+  }
+  if (collapse) {
+    chunk.pair_start.push_back(chunk.out.size());
+    PairKey key;
+    key.add(r[0].comment);
+    key.add(seq[0]);
+    key.add(seq[1]);
+    chunk.pair_key.push_back(key);
+  }
+  for (int m = 0; m < 2; ++m)
+    put_read(chunk, r[m], m + 1, seq[m], qual[m], l0, l1);
+}
+
+// write the pair number n, padded with zeros, at p
+void
+put_pair_no(char * p, long long int n)
+{
+  for (int j = pair_no_width - 1; j >= 0; --j, n /= 10) p[j] = char('0' + n % 10);
+}
+
+// the read group and sequence of the read at p in text, as put_read writes it; p is
+// moved to the next read
+void
+get_key_fields(const string& text, size_t& p, StrView& comment, StrView& seq)
+{
+  char sep = (out_format == fq_format? '\n' : '\t');
+  if (out_format == fq_format) ++p;
+  size_t q = text.find(':', p);
+  comment = StrView(text.data() + p, q - p);
+  p = text.find(sep, q) + 1;
+  if (out_format == sfq_format) p += 5;
+  q = text.find(sep, p);
+  seq = StrView(text.data() + p, q - p);
+  for (int k = (out_format == fq_format? 2 : 0); k >= 0; --k)
+    q = text.find('\n', q) + 1;
+  p = q;
+}
+
+// whether the pairs at p1 in text1 and at p2 in text2 have the same read group and sequences
+bool
+same_key_fields(const string& text1, size_t p1, const string& text2, size_t p2)
+{
+  for (int m = 0; m < 2; ++m) {
+    StrView comment1, seq1, comment2, seq2;
+    get_key_fields(text1, p1, comment1, seq1);
+    get_key_fields(text2, p2, comment2, seq2);
+    if ((m == 0 and comment1 != comment2) or seq1 != seq2) return false;
+  }
+  return true;
+}
+
+// keep the pairs of the chunk not seen before, and count the others
+void
+add_fragments(const Chunk& chunk)
+{
+  typedef unordered_multimap<PairKey,size_t,PairKeyHash>::iterator Iterator;
+  size_t n = chunk.pair_start.size();
+  for (size_t i = 0; i < n; ++i) {
+    pair<Iterator,Iterator> range = fragments.index.equal_range(chunk.pair_key[i]);
+    Iterator it = range.first;
+    while (it != range.second
+	   and not same_key_fields(fragments.text, fragments.start[it->second], chunk.out, chunk.pair_start[i]))
+      ++it;
+    if (it != range.second) {
+      ++fragments.multiplicity[it->second];
+      continue;
+    }
+    fragments.index.insert(make_pair(chunk.pair_key[i], fragments.multiplicity.size()));
+    fragments.multiplicity.push_back(1);
+    size_t shift = fragments.text.size() - chunk.pair_start[i];
+    fragments.start.push_back(fragments.text.size());
+    for (int m = 0; m < 2; ++m)
+      fragments.pair_no_pos.push_back(chunk.pair_no_pos[2 * i + m] + shift);
+    size_t end = (i + 1 < n? chunk.pair_start[i + 1] : chunk.out.size());
+    fragments.text.append(chunk.out, chunk.pair_start[i], end - chunk.pair_start[i]);
+  }
+}
+
+// number and write the distinct pairs
+void
+write_fragments(OutputWriter& out_writer)
+{
+  string out;
+  size_t n = fragments.multiplicity.size();
+  fragments.start.push_back(fragments.text.size());
+  for (size_t i = 0; i < n; ++i) {
+    long long int pair_no = next_pair_no++;
+    size_t p = fragments.start[i];
+    for (int m = 0; m < 2; ++m) {
+      size_t q = fragments.pair_no_pos[2 * i + m];
+      out.append(fragments.text, p, q - p);
+      out.append(pair_no_width, '0');
+      put_pair_no(&out[out.size() - pair_no_width], pair_no);
+      if (fragments.multiplicity[i] > 1) {
+	out += 'x';
+	out += to_string(fragments.multiplicity[i]);
+      }
+      p = q + pair_no_width;
+    }
+    out.append(fragments.text, p, fragments.start[i + 1] - p);
+    if (out.size() >= write_size or i + 1 == n)
+      out_writer.write(1, out);
+  }
+}
+
+// read the lines of up to max_pairs pairs into the chunk; false at the end of input
+bool
+read_chunk(BlockLineReader& reader, Chunk& chunk, int max_pairs)
+{
+  chunk.input.clear();
+  chunk.line_start.clear();
+  chunk.n_pairs = 0;
+  StrView line;
+  while (chunk.n_pairs < max_pairs and reader.get_line(line)) {
+    if (in_format < 0) {
+      in_format = detect_format(line);
+      if (out_format < 0) out_format = in_format;
+      if (global::verbosity > 0)
+	clog << "detected input format [" << format_name[in_format] << "]\n";
+    }
+    int lines_per_pair = (in_format == fq_format? 8 : 2);
+    for (int k = 0; k < lines_per_pair; ++k) {
+      if (k > 0 and not reader.get_line(line)) {
+	cerr << "error: input ends within a read pair" << endl;
+	exit(1);
+      }
+      chunk.line_start.push_back(chunk.input.size());
+      chunk.input.append(line.data(), line.size());
+      chunk.input += '\n';
+    }
+    ++chunk.n_pairs;
+    if (input_phred == 0) {
+      // the qualities of the first read
+      StrView q = chunk_line(chunk, in_format == fq_format? 3 : 0);
+      if (in_format != fq_format) {
+	size_t p = q.size();
+	while (p > 0 and q[p - 1] != '\t') --p;
+	q = q.substr(p + (in_format == sfq_format? 5 : 0));
+      }
+      input_phred = detect_phred(q);
+    }
+  }
+  chunk.line_start.push_back(chunk.input.size());
+  return chunk.n_pairs > 0;
+}
+
+
+int
+main(int argc, char* argv[])
+{
+  string progName(argv[0]);
+
+  char c;
+  while ((c = getopt(argc, argv, "p:o:e:b:s:k:m:dN:v")) != -1) {
+    switch (c) {
+    case 'p':
+      input_phred = atoi(optarg);
+      break;
+    case 'o':
+      out_format = find(format_name, format_name + 3, string(optarg)) - format_name;
+      if (out_format == 3) {
+	cerr << "unknown output format: " << optarg << endl;
+	exit(1);
+      }
+      break;
+    case 'e':
+      min_len_either = atoi(optarg);
+      break;
+    case 'b':
+      min_len_each = atoi(optarg);
+      break;
+    case 's':
+      min_len_sum = atoi(optarg);
+      break;
+    case 'k':
+      if (not kmer_filter.load(optarg)) {
+	cerr << "error opening k-mer filter: " << optarg << endl;
+	exit(1);
+      }
+      use_kmer_filter = true;
+      break;
+    case 'm':
+      min_kmer_hits = atoi(optarg);
+      break;
+    case 'd':
+      collapse = true;
+      break;
+    case 'N':
+      global::num_threads = PipelineTuner::parse_num_threads(optarg);
+      break;
+    case 'v':
+      global::verbosity++;
+      break;
+    default:
+      cerr << "unrecognized option: " << c << endl;
+      exit(1);
+    }
+  }
+
+  if (optind + 1 < argc) {
+    cerr << "use: " << argv[0] << " [-p <input_phred>] [-o fq|tfq|sfq] [-e <min_len_either>]"
+	 << " [-b <min_len_each>] [-s <min_len_sum>] [-k <kmer_filter> [-m <min_kmer_hits>]]"
+	 << " [-d] [-N <threads>] [<reads>]" << endl;
+    exit(1);
+  }
+  if (min_len_either == 0 and min_len_each == 0 and min_len_sum == 0)
+    min_len_either = 20;
+
+  if (global::verbosity > 0)
+    clog << "number of threads: " << (global::num_threads > 0? to_string(global::num_threads) : "auto") << '\n';
+
+  // gzip input is inflated by the line reader
+  igzstream in(optind < argc? argv[optind] : "-", false);
+  if (!in) {
+    cerr << "error opening reads file: " << argv[optind] << endl;
+    exit(1);
+  }
+  BlockLineReader reader(&in);
+  OutputWriter out_writer;
+
+  long long next_chunk_in = 0;
+  PipelineTuner tuner(global::num_threads);
+  OrderedPipeline<Chunk> pipeline(tuner.max_threads(), 2 * tuner.max_threads());
+  pipeline.set_tuner(&tuner);
+
+  pipeline.run([&] (Chunk& chunk) {
+      if (not read_chunk(reader, chunk, tuner.chunk_size()))
+	return false;
+      chunk.chunk_id = next_chunk_in++;
+      return true;
+    },
+    [&] (Chunk& chunk, int tid) {
+      double start = omp_get_wtime();
+      chunk.thread_id = tid;
+      chunk.out.clear();
+      chunk.pair_no_pos.clear();
+      chunk.pair_start.clear();
+      chunk.pair_key.clear();
+      chunk.n_short = 0;
+      chunk.n_no_kmer_hits = 0;
+      chunk.n_qual_trimmed = 0;
+      chunk.n_polyx_trimmed = 0;
+      size_t lines_per_pair = (in_format == fq_format? 8 : 2);
+      for (int i = 0; i < chunk.n_pairs; ++i)
+	process_pair(chunk, i * lines_per_pair);
+      chunk.work_seconds = omp_get_wtime() - start;
+    },
+    [&] (Chunk& chunk, int tid) {
+      tuner.chunk_done(chunk.n_pairs, chunk.input.size(), chunk.work_seconds);
+      if (collapse) {
+	add_fragments(chunk);
+      } else {
+	// both reads of a pair get the same number
+	for (size_t i = 0; i < chunk.pair_no_pos.size(); i += 2) {
+	  long long int n = next_pair_no++;
+	  for (int m = 0; m < 2; ++m) put_pair_no(&chunk.out[chunk.pair_no_pos[i + m]], n);
+	}
+	out_writer.write(1, chunk.out);
+      }
+      total_pairs += chunk.n_pairs;
+      total_short += chunk.n_short;
+      total_no_kmer_hits += chunk.n_no_kmer_hits;
+      total_qual_trimmed += chunk.n_qual_trimmed;
+      total_polyx_trimmed += chunk.n_polyx_trimmed;
+      if (global::verbosity > 1)
+	cerr << "chunk=" << chunk.chunk_id << " work_thread=" << chunk.thread_id
+	     << " print_thread=" << tid << '\n';
+    });
+  if (collapse)
+    write_fragments(out_writer);
+  out_writer.close();
+
+  if (global::verbosity > 0) {
+    tuner.print_stats(clog);
+    print_read_stats(clog, "lines", reader.n_lines(), reader.n_bytes(), reader.seconds());
+    clog << "pairs: " << total_pairs << " read, " << total_short << " dropped as short, "
+	 << total_no_kmer_hits << " without library k-mers, "
+	 << next_pair_no << " written; reads trimmed: " << total_qual_trimmed << " by quality, "
+	 << total_polyx_trimmed << " by poly-X tail\n";
+  }
+  long long int n_kept = total_pairs - total_short - total_no_kmer_hits;
+  if (use_kmer_filter) {
+    long long int n = total_pairs - total_short;
+    clog << "k-mer filter: kept " << n_kept << " of " << n << " pairs ("
+	 << (n > 0? 100.0 * n_kept / n : 0.0) << "%)\n";
+  }
+  if (collapse)
+    clog << "duplicates: " << n_kept << " pairs collapsed into " << next_pair_no << " fragments ("
+	 << (n_kept > 0? 100.0 * next_pair_no / n_kept : 0.0) << "%)\n";
+
+  return 0;
+}
@@ -28,7 +28,7 @@ public:
 string prog_name;
 vector<TSD> tsd;
 vector<vector<vector<int>>> cluster;
-string (*cnp)(const string &);
+StrView (*cnp)(const StrView &);
 void (*fnp)(const string &, Clone &, int &);
 int flank_len = 30;
 int min_non_repeat_bp = 20;
@@ -46,6 +46,21 @@ int total_bp_right;
 int total_bp_mid;
 
 
+// number of identical pairs the fragment stands for: from the packed name with -P,
+// otherwise from the tag set when the name was unpacked; 1 if not collapsed
+int
+get_multiplicity(const vector<SamMapping> & v_sm)
+{
+  if (fnp != NULL) {
+    Clone c;
+    int nip;
+    fnp(v_sm[0].name().str(), c, nip);
+    return c.multiplicity;
+  }
+  long long int res;
+  return v_sm[0].get_int_tag(SamMapping::multiplicity_tag, res)? int(res) : 1;
+}
+
 void
 process_mapping_set(const string & clone_name, vector<SamMapping> & v_sm)
 {
@@ -55,6 +70,8 @@ process_mapping_set(const string & clone_name, vector<SamMapping> & v_sm)
     exit(EXIT_FAILURE);
   }
 
+  int mult = get_multiplicity(v_sm);
+
   // convert to Mapping structures
   vector<Mapping> v_m(2);
   for (size_t j = 0; j < v_sm.size(); ++j) {
@@ -72,15 +89,10 @@ process_mapping_set(const string & clone_name, vector<SamMapping> & v_sm)
     for (size_t j = 0; j < v_m.size(); ++j) {
       if (!v_sm[j].mapped) continue;
       int edit_dist = 0;
-      for (size_t i = 0; i < v_sm[j].rest.size(); ++i) {
-	if (v_sm[j].rest[i].key == "NM") {
-	  edit_dist = atoi(v_sm[j].rest[i].value.c_str());
-	  break;
-	}
-      }
+      v_sm[j].get_nm(edit_dist);
       // discard fragment if NM too large
       if (edit_dist > max_nm) {
-	LOG(1) << "[" << v_sm[0].name << "]: discarding; large NM\n";
+	LOG(1) << "[" << v_sm[0].name() << "]: discarding; large NM\n";
 	return;
       }
       if (edit_dist > 0) {
@@ -88,7 +100,7 @@ process_mapping_set(const string & clone_name, vector<SamMapping> & v_sm)
 	v_m[j].dbPos[1] -= edit_dist;
       }
       if (v_m[j].dbPos[1] - v_m[j].dbPos[0] + 1 < min_read_len_left) {
-	LOG(1) << "[" << v_sm[0].name << "]: discarding; small read len after NM trim\n";
+	LOG(1) << "[" << v_sm[0].name() << "]: discarding; small read len after NM trim\n";
 	return;
       }
       if (min_pos < 0 or v_m[j].dbPos[0] < min_pos) min_pos = v_m[j].dbPos[0];
@@ -111,7 +123,7 @@ process_mapping_set(const string & clone_name, vector<SamMapping> & v_sm)
 		 and max_pos < tsd[1].start + min_non_repeat))) {
     */
     if (is_alt and non_repeat_bp < min_non_repeat_bp) {
-      LOG(1) << "[" << v_sm[0].name << "]: discarding: not enough non-repeat bp\n";
+      LOG(1) << "[" << v_sm[0].name() << "]: discarding: not enough non-repeat bp\n";
       return;
     }
   }
@@ -119,14 +131,14 @@ process_mapping_set(const string & clone_name, vector<SamMapping> & v_sm)
   // count bp mapped left/right/between TSDs
   for (size_t j = 0; j < v_sm.size(); ++j) {
     if (not v_sm[j].mapped) continue;
-    total_bp += int(v_m[j].dbPos[1] - v_m[j].dbPos[0] + 1);
+    total_bp += mult * int(v_m[j].dbPos[1] - v_m[j].dbPos[0] + 1);
     if (v_m[j].dbPos[1] < tsd[0].start - flank_len)
-      total_bp_left += int(v_m[j].dbPos[1] - v_m[j].dbPos[0] + 1);
+      total_bp_left += mult * int(v_m[j].dbPos[1] - v_m[j].dbPos[0] + 1);
     else if (v_m[j].dbPos[0] > tsd[tsd.size() - 1].end + flank_len)
-      total_bp_right += int(v_m[j].dbPos[1] - v_m[j].dbPos[0] + 1);
+      total_bp_right += mult * int(v_m[j].dbPos[1] - v_m[j].dbPos[0] + 1);
     else if (tsd.size() == 2 and v_m[j].dbPos[0] > tsd[0].end + flank_len
 	and v_m[j].dbPos[1] < tsd[1].start - flank_len)
-      total_bp_mid += int(v_m[j].dbPos[1] - v_m[j].dbPos[0] + 1);
+      total_bp_mid += mult * int(v_m[j].dbPos[1] - v_m[j].dbPos[0] + 1);
   }
 
   // check if fragment completely captures either TSD
@@ -137,41 +149,41 @@ process_mapping_set(const string & clone_name, vector<SamMapping> & v_sm)
 	  and v_m[j].dbPos[0] <= tsd[i].start - flank_len
 	  and v_m[j].dbPos[1] >= tsd[i].end + flank_len) {
 	// captures this TSD!
-	tsd[i].count++;
-	LOG(1) << "[" << v_sm[0].name << "]: captures tsd [" << i + 1 << "]\n";
+	tsd[i].count += mult;
+	LOG(1) << "[" << v_sm[0].name() << "]: captures tsd [" << i + 1 << "]\n";
 	//return;
       }
     }
   }
 
   if (v_sm.size() != 2) {
-    LOG(1) << "[" << v_sm[0].name << "]: discarding; unpaired\n";
+    LOG(1) << "[" << v_sm[0].name() << "]: discarding; unpaired\n";
     return;
   }
 
   if (v_m[0].dbPos[1] - v_m[0].dbPos[0] + 1 < min_read_len
       or v_m[1].dbPos[1] - v_m[1].dbPos[0] + 1 < min_read_len) {
-    LOG(1) << "[" << v_sm[0].name << "]: discarding; one read too small\n";
+    LOG(1) << "[" << v_sm[0].name() << "]: discarding; one read too small\n";
     return;
   }
 
   if (not v_sm[0].mapped or not v_sm[1].mapped) {
-    LOG(1) << "[" << v_sm[0].name << "]: discarding; not both mapped\n";
+    LOG(1) << "[" << v_sm[0].name() << "]: discarding; not both mapped\n";
     return;
   }
 
   if (v_sm[0].mqv < min_mqv and v_sm[1].mqv < min_mqv) {
-    LOG(1) << "[" << v_sm[0].name << "]: discarding; neither read has min mqv\n";
+    LOG(1) << "[" << v_sm[0].name() << "]: discarding; neither read has min mqv\n";
     return;
   }
 
   if (not v_sm[0].flags[1] or not v_sm[1].flags[1]) {
-    LOG(1) << "[" << v_sm[0].name << "]: discarding; not proper pair\n";
+    LOG(1) << "[" << v_sm[0].name() << "]: discarding; not proper pair\n";
     return;
   }
 
   if (v_sm[0].mqv < min_mqv or v_sm[1].mqv < min_mqv) {
-    LOG(1) << "[" << v_sm[0].name << "]: discarding; one read doesn't have min mqv\n";
+    LOG(1) << "[" << v_sm[0].name() << "]: discarding; one read doesn't have min mqv\n";
     return;
   }
 
@@ -179,15 +191,14 @@ process_mapping_set(const string & clone_name, vector<SamMapping> & v_sm)
   int rg_idx = -1;
   if (fnp == NULL) {
     // get read group info from SAM tags
-    size_t k = 0;
-    while (k < v_sm[0].rest.size() and v_sm[0].rest[k].key != "RG") ++k;
-    if (k >= v_sm[0].rest.size()) {
+    StrView rg_field;
+    if (not v_sm[0].get_tag(SAM_TAG('R','G'), rg_field)) {
       cerr << "could not determine read group for clone: " << clone_name << "\n";
       exit(EXIT_FAILURE);
     }
-    ReadGroup * rg_p = global::rg_set.find_by_name(v_sm[0].rest[k].value);
+    ReadGroup * rg_p = global::rg_set.find_by_name(rg_field.str());
     if (rg_p == NULL) {
-      cerr << "error: missing read group [" << v_sm[0].rest[k].value
+      cerr << "error: missing read group [" << rg_field
 	   << "] of clone [" << clone_name << "]\n";
       exit(EXIT_FAILURE);
     }
@@ -197,7 +208,7 @@ process_mapping_set(const string & clone_name, vector<SamMapping> & v_sm)
     // use full name parser to get read group info
     Clone c;
     int nip;
-    fnp(v_sm[0].name, c, nip);
+    fnp(v_sm[0].name().str(), c, nip);
     pairing = c.pairing;
 
     // HACK: clone should store read group, not pairing pointer
@@ -216,7 +227,7 @@ process_mapping_set(const string & clone_name, vector<SamMapping> & v_sm)
   // if this is the null allele and fragment length is too small, ignore
   int frag_len = pairing->get_t_len(v_m[0], 0, v_m[1], 0);
   if (tsd.size() == 1 and frag_len < pairing->mean - expected_insert_size/2) {
-    LOG(1) << "[" << v_sm[0].name << "]: discarding; frag_len too small\n";
+    LOG(1) << "[" << v_sm[0].name() << "]: discarding; frag_len too small\n";
     return;
   }
 
@@ -227,25 +238,26 @@ process_mapping_set(const string & clone_name, vector<SamMapping> & v_sm)
   if (tsd.size() == 1) {
     if (left_end <= tsd[0].start - flank_len
 	and right_end >= tsd[0].end + flank_len) {
-      LOG(1) << "[" << v_sm[0].name << "]: straddles single tsd\n";
-      cluster[0][rg_idx].push_back(frag_len);
+      LOG(1) << "[" << v_sm[0].name() << "]: straddles single tsd\n";
+      cluster[0][rg_idx].insert(cluster[0][rg_idx].end(), mult, frag_len);
     }
   } else {
     if (left_end <= tsd[0].start - flank_len and
 	right_end >= tsd[1].end + flank_len) {
-      LOG(1) << "[" << v_sm[0].name << "]: straddles both tsds\n";
+      LOG(1) << "[" << v_sm[0].name() << "]: straddles both tsds\n";
 
-      cluster[0][rg_idx].push_back(pairing->get_t_len(v_m[0], 0, v_m[1], 0));
+      cluster[0][rg_idx].insert(cluster[0][rg_idx].end(), mult,
+				pairing->get_t_len(v_m[0], 0, v_m[1], 0));
     } else if (left_end <= tsd[0].start - flank_len and
 	       right_end >= tsd[0].end + flank_len and
 	       right_end <= tsd[1].start - flank_len) {
-      LOG(1) << "[" << v_sm[0].name << "]: straddles left tsd\n";
-      cluster[1][rg_idx].push_back(frag_len);
+      LOG(1) << "[" << v_sm[0].name() << "]: straddles left tsd\n";
+      cluster[1][rg_idx].insert(cluster[1][rg_idx].end(), mult, frag_len);
     } else if (left_end >= tsd[0].end + flank_len and
 	       left_end <= tsd[1].start - flank_len and
 	       right_end >= tsd[1].end + flank_len) {
-      LOG(1) << "[" << v_sm[0].name << "]: straddles right tsd\n";
-      cluster[2][rg_idx].push_back(frag_len);
+      LOG(1) << "[" << v_sm[0].name() << "]: straddles right tsd\n";
+      cluster[2][rg_idx].insert(cluster[2][rg_idx].end(), mult, frag_len);
     }
   }
 }
@@ -260,10 +272,10 @@ print_cluster_evidence(const vector<vector<int>> & v, ostream & os)
   }
 }
 
-string
-default_cnp(const string& s)
+StrView
+default_cnp(const StrView& s)
 {
-  return string(s);
+  return s;
 }
 
 void
@@ -417,14 +429,17 @@ main(int argc, char* argv[])
   LOG(1) << "internal naming: [" << (cnp == default_cnp? "no" : "yes") << "]\n";
 
   {
-    igzstream mapIn(optind < argc? argv[optind] : "-");
+    // gzip and BGZF input is inflated by the mapping reader
+    igzstream mapIn(optind < argc? argv[optind] : "-", false);
     if (!mapIn) {
       cerr << "error opening mappings file: " << argv[optind] << endl;
       exit(EXIT_FAILURE);
     }
 
     SamMappingSetGen map_gen(&mapIn, cnp, NULL, &global::refDict, not is_alt);
-    pair<string,vector<SamMapping> >* m = map_gen.get_next();
+    // SEQ and QUAL are not used
+    map_gen.set_fields(SamMapping::load_tags);
+    SamMappingSet* m = map_gen.get_next();
     int n_fragments = 0;
     while (m != NULL) {
       ++n_fragments;
@@ -432,6 +447,7 @@ main(int argc, char* argv[])
       delete m;
       m = map_gen.get_next();
     }
+    if (global::verbosity > 0) map_gen.print_stats(clog);
   }
 
   if (tsd.size() == 1) {
@@ -14,6 +14,8 @@ class igzstream : public boost::iostreams::filtering_istream {
 private:
   // if this is not cin, store ifstream object, and delete it when done
   std::unique_ptr<std::ifstream> p_file;
+  // if false, gzip input is passed through for the reader to inflate
+  bool decompress;
 
   // no copy constructor
   igzstream(const igzstream &) : std::basic_ios<char>(), boost::iostreams::filtering_istream() {}
@@ -22,12 +24,12 @@ private:
   igzstream & operator = (const igzstream &) { return *this; }
 
 public:
-  igzstream() {}
+  igzstream() : decompress(true) {}
 
-  igzstream(const char * name) { open(name); }
-  igzstream(const std::string& name) { open(name.c_str()); }
+  igzstream(const char * name, bool _decompress = true) : decompress(_decompress) { open(name); }
+  igzstream(const std::string& name, bool _decompress = true) : decompress(_decompress) { open(name.c_str()); }
 
-  igzstream(std::istream & is) { attach(is); }
+  igzstream(std::istream & is) : decompress(true) { attach(is); }
 
   void open(const char * name) {
     if (strncmp(name, "-", 2) == 0) {
@@ -45,7 +47,7 @@ public:
   void attach(std::istream& is) {
     int c = is.peek();
     is.clear();
-    if (c == 31) {
+    if (c == 31 and decompress) {
       push(boost::iostreams::gzip_decompressor());
     }
     push(is);
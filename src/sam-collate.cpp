@@ -0,0 +1,242 @@
+using namespace std;
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <omp.h>
+
+#include "igzstream.hpp"
+#include "globals.hpp"
+#include "common.hpp"
+#include "BlockLineReader.hpp"
+#include "ParallelInflateBuf.hpp"
+#include "MateCollator.hpp"
+#include "BamWriter.hpp"
+#include "OutputWriter.hpp"
+#include "PipelineTuner.hpp"
+
+// bring the mates of paired reads next to each other in input that is sorted otherwise,
+// usually by coordinate; records of unpaired reads and header lines pass through as they
+// come; SAM input gives SAM output, BAM input gives BAM output
+
+
+const size_t write_size = 1u << 20;
+
+int num_threads = 1;
+size_t max_mb = 1024;
+string tmp_dir;
+// the clone name is the second field of a packed read name, as in cloneNameParser
+bool packed_names = false;
+int level = 0;
+
+OutputWriter* out_writer = NULL;
+BgzfWriter* bam_out = NULL;
+string out_buf;
+long long int n_records = 0;
+
+// otherwise, it is the read name without any /1 or /2 suffix, as in default_cid_parser
+inline StrView
+clone_name(const StrView& qname)
+{
+  if (packed_names) return cloneNameParser(qname);
+  size_t n = qname.size();
+  if (n >= 2 and qname[n - 2] == '/' and (qname[n - 1] == '1' or qname[n - 1] == '2'))
+    return qname.substr(0, n - 2);
+  return qname;
+}
+
+void
+emit_sam(const StrView& rec)
+{
+  out_buf.append(rec.data(), rec.size());
+  out_buf += '\n';
+  if (out_buf.size() >= write_size) out_writer->write(1, out_buf);
+}
+
+void
+emit_bam(const StrView& rec)
+{
+  bam_out->write(rec.data(), rec.size());
+}
+
+void
+get_bam_bytes(BlockLineReader& reader, size_t n, StrView& s, const char * what)
+{
+  if (not reader.get_bytes(n, s)) {
+    cerr << "error: truncated BAM input while reading " << what << endl;
+    exit(1);
+  }
+}
+
+inline size_t
+get_le32(const char * p)
+{
+  return (size_t)(unsigned char)p[0] | ((size_t)(unsigned char)p[1] << 8)
+    | ((size_t)(unsigned char)p[2] << 16) | ((size_t)(unsigned char)p[3] << 24);
+}
+
+void
+collate_sam(BlockLineReader& reader, MateCollator& collator)
+{
+  StrView line;
+  while (reader.get_line(line)) {
+    ++n_records;
+    if (line.size() == 0) continue;
+    size_t i = line.find('\t');
+    if (line[0] == '@' or i == StrView::npos) {
+      emit_sam(line);
+      continue;
+    }
+    int flags = atoi(line.data() + i + 1);
+    if ((flags & 0x1) == 0) {
+      emit_sam(line);
+    } else {
+      collator.add(clone_name(line.substr(0, i)), line);
+    }
+  }
+  if (reader.bad()) {
+    cerr << "error reading SAM input" << endl;
+    exit(1);
+  }
+}
+
+void
+collate_bam(BlockLineReader& reader, MateCollator& collator)
+{
+  // the header is copied as it is
+  StrView s;
+  get_bam_bytes(reader, 8, s, "header");
+  bam_out->write(s.data(), s.size());
+  get_bam_bytes(reader, get_le32(s.data() + 4), s, "header text");
+  bam_out->write(s.data(), s.size());
+  get_bam_bytes(reader, 4, s, "header");
+  bam_out->write(s.data(), s.size());
+  size_t n_ref = get_le32(s.data());
+  for (size_t i = 0; i < n_ref; ++i) {
+    get_bam_bytes(reader, 4, s, "reference name");
+    bam_out->write(s.data(), s.size());
+    get_bam_bytes(reader, get_le32(s.data()) + 4, s, "reference name");
+    bam_out->write(s.data(), s.size());
+  }
+  // a record is handled with its block_size prefix
+  StrView rec;
+  while (reader.peek_bytes(4, s)) {
+    size_t block_size = get_le32(s.data());
+    if (block_size < 32) {
+      cerr << "error: bad BAM record size: " << block_size << endl;
+      exit(1);
+    }
+    get_bam_bytes(reader, 4 + block_size, rec, "record");
+    ++n_records;
+    size_t l_read_name = (unsigned char)rec[4 + 8];
+    int flags = (unsigned char)rec[4 + 14] | ((unsigned char)rec[4 + 15] << 8);
+    if ((flags & 0x1) == 0 or l_read_name == 0 or 32 + l_read_name > block_size) {
+      emit_bam(rec);
+    } else {
+      collator.add(clone_name(StrView(rec.data() + 4 + 32, l_read_name - 1)), rec);
+    }
+  }
+  if (not reader.done() or reader.bad()) {
+    cerr << "error: truncated BAM input while reading record" << endl;
+    exit(1);
+  }
+}
+
+
+int
+main(int argc, char* argv[])
+{
+  string progName(argv[0]);
+  if (getenv("TMPDIR") != NULL) tmp_dir = getenv("TMPDIR");
+  if (tmp_dir.size() == 0) tmp_dir = "/tmp";
+
+  char c;
+  while ((c = getopt(argc, argv, "m:T:Pc:N:v")) != -1) {
+    switch (c) {
+    case 'm':
+      max_mb = atol(optarg);
+      if (max_mb == 0) {
+	cerr << "invalid memory cap: " << optarg << endl;
+	exit(1);
+      }
+      break;
+    case 'T':
+      tmp_dir = optarg;
+      break;
+    case 'P':
+      packed_names = true;
+      break;
+    case 'c':
+      level = atoi(optarg);
+      break;
+    case 'N':
+      num_threads = PipelineTuner::parse_num_threads(optarg);
+      if (num_threads == 0) num_threads = omp_get_max_threads();
+      break;
+    case 'v':
+      global::verbosity++;
+      break;
+    default:
+      cerr << "unrecognized option: " << c << endl;
+      exit(1);
+    }
+  }
+
+  if (optind + 1 < argc) {
+    cerr << "use: " << argv[0] << " [-m <memory_mb>] [-T <tmp_dir>] [-P] [-c <bam_level>] [-N <threads>|auto] [-v] [<sam/bam file>]" << endl;
+    exit(1);
+  }
+
+  // BGZF blocks are inflated by ParallelInflateBuf, anything else by the reader
+  igzstream in(optind < argc? argv[optind] : "-", false);
+  if (!in) {
+    cerr << "error opening mappings file: " << argv[optind] << endl;
+    exit(1);
+  }
+  ParallelInflateBuf inflate_buf(&in, num_threads);
+  istream inflated(&inflate_buf);
+  BlockLineReader reader(&inflated);
+
+  StrView magic;
+  bool bam_input = (reader.peek_bytes(4, magic) and magic == StrView("BAM\1", 4));
+  out_writer = new OutputWriter();
+  if (bam_input) bam_out = new BgzfWriter(out_writer, 1, level);
+
+  MateCollator collator(max_mb << 20, tmp_dir, bam_input? emit_bam : emit_sam);
+  if (bam_input) {
+    collate_bam(reader, collator);
+  } else {
+    collate_sam(reader, collator);
+  }
+  collator.finish();
+
+  if (bam_input) {
+    bam_out->close();
+    delete bam_out;
+  } else if (out_buf.size() > 0) {
+    out_writer->write(1, out_buf);
+  }
+  out_writer->close();
+  delete out_writer;
+
+  if (collator.n_unmatched() > 0) {
+    cerr << "warning: some paired reads missed mate mappings: " << collator.n_unmatched()
+	 << " records, e.g. [";
+    if (bam_input) {
+      const string& s = collator.unmatched_example();
+      cerr << s.substr(4 + 32, (unsigned char)s[4 + 8] - 1);
+    } else {
+      cerr << collator.unmatched_example();
+    }
+    cerr << "]" << endl;
+  }
+  if (global::verbosity > 0) {
+    print_read_stats(clog, bam_input? "BAM records" : "SAM lines", n_records, reader.n_bytes(),
+		     reader.seconds());
+    if (inflate_buf.is_bgzf())
+      clog << "BGZF blocks inflated: " << inflate_buf.n_blocks() << " with " << num_threads << " threads\n";
+    collator.print_stats(clog);
+  }
+
+  return 0;
+}
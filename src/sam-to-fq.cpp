@@ -15,121 +15,38 @@ using namespace std;
 #include "SamMapping.hpp"
 #include "SamMappingSetGen.hpp"
 #include "common.hpp"
+#include "OrderedPipeline.hpp"
+#include "PipelineTuner.hpp"
+#include "OutputWriter.hpp"
 
 
 bool save_rgid = false;
-string (*cnp)(const string&);
+StrView (*cnp)(const StrView&);
 void (*fnp)(const string&, Clone&, int&);
 
 
+// clones going through the pipeline together; chunk objects are reused
 class Chunk
 {
 public:
   long long int chunk_id;
   int thread_id;
-  stringstream* out_str;
-  stringstream* err_str;
-};
-
-class ChunkComparator
-{
-public:
-  bool operator() (const Chunk& lhs, const Chunk& rhs) { return lhs.chunk_id > rhs.chunk_id; }
+  SamMappingChunk input;
+  double work_seconds;
+  vector<SamMappingSet*> sets;
+  OutputBuffer out_str;
+  stringstream err_str;
 };
 
 
 void
 addSQToRefDict(const string& line)
 {
-  strtk::std_string::token_list_type token_list;
-  strtk::split("\t", line, back_inserter(token_list));
-  strtk::std_string::token_list_type::iterator itr = token_list.begin();
-
-  string s = string(itr->first, itr->second);
-  if (!s.compare("@SQ")) {
-    string contig_name = string();
-    long long int contig_len = 0;
-    while (contig_name.length() == 0 || contig_len == 0) {
-      ++itr;
-      if (itr == token_list.end()) {
-	cerr << "did not find contig name and len in @SQ line: " << line << endl;
-	exit(1);
-      }
-      s = string(itr->first, itr->second);
-      if (!s.substr(0, 2).compare("SN")) {
-	contig_name = s.substr(3);
-      } else if (!s.substr(0, 2).compare("LN")) {
-	contig_len = atoll(s.substr(3).c_str());
-      }
-    }
-    Contig* contig = &global::refDict[contig_name];
-    if (contig->name.length() == 0) {
-      //cerr << "error: missing sequence for contig [" << contig_name << "]";
-      //exit(1);
-      contig->name = contig_name;
-      contig->len = contig_len;
-      contig->idx = global::refDict.size() - 1;
-      if (global::verbosity > 0)
-	clog << "added contig [" << contig->name << "] of length [" << contig->len << "]" << '\n';
-    } else {
-      cerr << "error: contig [" << contig->name << "] already exists!" << endl;
-      exit(1);
-    }
-  }
+  add_sq_line_to_dict(line, global::refDict);
   //cout << line << endl;
 }
 
 
-void
-print_read_from_mapping(const string& s, const SamMapping& m, ostream* os)
-{
-  string tail;
-  if (((m.flags.to_ulong() & 0x1) != 0) and m.name == s) {
-    if ((m.flags.to_ulong() & 0x40) != 0) {
-      tail = "/1";
-    } else {
-      tail = "/2";
-    }
-  }
-  string seq;
-  string qual;
-  if (m.cigar.find('H') == string::npos and m.seq != "*" and m.seq.size() == m.qvString.size()) {
-    if ((m.flags.to_ulong() & 0x10) != 0) {
-      seq = reverseComplement(m.seq);
-      qual = reverse(m.qvString);
-    } else {
-      seq = m.seq;
-      qual = m.qvString;
-    }
-  } else {
-    seq = "*";
-    qual = "*";
-  }
-  string rg_num_id;
-  if (save_rgid) {
-    string rg_name;
-    size_t i = 0;
-    while (i < m.rest.size() and m.rest[i].key != "RG") ++i;
-    if (i < m.rest.size()) {
-      // found rg name (m.rest[i].value)
-      rg_name = m.rest[i].value;
-    } else {
-      rg_name = global::default_rg_name;
-    }
-    ReadGroup * rg_p = global::rg_set.find_by_name(rg_name);
-    if (rg_p == NULL) {
-      cerr << "missing read group: " << rg_name << "\n";
-      exit(EXIT_FAILURE);
-    }
-    rg_num_id = rg_p->get_num_id();
-  }
-  *os << '@' << m.name << tail << '\n'
-      << seq << '\n'
-      << '+' << rg_num_id << '\n'
-      << qual << '\n';
-}
-
-
 void
 process_mapping_set(const string& s, vector<SamMapping>& v, ostream* out_str)
 {
@@ -142,15 +59,15 @@ process_mapping_set(const string& s, vector<SamMapping>& v, ostream* out_str)
   */
 
   for (size_t i = 0; i < v.size(); ++i) {
-    print_read_from_mapping(s, v[i], out_str);
+    print_fastq_from_SamMapping(*out_str, s, v[i], save_rgid);
   }
 }
 
 
-string
-default_cnp(const string& s)
+StrView
+default_cnp(const StrView& s)
 {
-  return string(s);
+  return s;
 }
 
 
@@ -168,7 +85,7 @@ main(int argc, char* argv[])
       pairing_file = optarg;
       break;
     case 'N':
-      global::num_threads = atoi(optarg);
+      global::num_threads = PipelineTuner::parse_num_threads(optarg);
       break;
     case 'P':
       cnp = cloneNameParser;
@@ -194,7 +111,8 @@ main(int argc, char* argv[])
     exit(1);
   }
 
-  if (global::verbosity > 0) clog << "number of threads: " << global::num_threads << '\n';
+  if (global::verbosity > 0)
+    clog << "number of threads: " << (global::num_threads > 0? to_string(global::num_threads) : "auto") << '\n';
 
   if (pairing_file.size() > 0) {
     igzstream pairingIn(pairing_file);
@@ -205,97 +123,69 @@ main(int argc, char* argv[])
     global::rg_set.load(pairingIn);
   }
 
-  igzstream mapIn(optind < argc? argv[optind] : "-");
+  // gzip and BGZF input is inflated by the mapping reader
+  igzstream mapIn(optind < argc? argv[optind] : "-", false);
   if (!mapIn) {
     cerr << "error opening mappings file: " << argv[optind] << endl;
     exit(1);
   }
 
   SamMappingSetGen mapGen(&mapIn, cnp, addSQToRefDict, &global::refDict, true);
-  pair<string,vector<SamMapping> >* m = mapGen.get_next();
+  mapGen.set_fields(SamMapping::load_seq | SamMapping::load_tags);
+  SamMappingSet* m = mapGen.get_next();
   if (m != NULL) {
     process_mapping_set(m->first, m->second, &cout);
     delete m;
+    cout.flush();
+    // the rest is written to stdout from a separate thread
+    OutputWriter out_writer;
 
-    priority_queue<Chunk,vector<Chunk>,ChunkComparator> h;
     long long next_chunk_in = 0;
-    long long next_chunk_out = 0;
-    int chunk_size = 1000;
-
-    //omp_lock_t input_lock;
-    //omp_init_lock(&input_lock);
-#pragma omp parallel num_threads(global::num_threads)
-    {
-      int tid = omp_get_thread_num();
-      pair<string,vector<SamMapping> >* local_m;
-      vector<pair<string,vector<SamMapping> >* > local_m_vector(chunk_size);
-      int load;
-      while (true) {
-	Chunk chunk;
-	//chunk.chunk_id = i;
+    PipelineTuner tuner(global::num_threads);
+    OrderedPipeline<Chunk> pipeline(tuner.max_threads(), 2 * tuner.max_threads());
+    pipeline.set_tuner(&tuner);
+
+    pipeline.run([&] (Chunk& chunk) {
+	// only group raw records by clone here; parsing happens in the workers
+	if (not mapGen.get_chunk(chunk.input, tuner.chunk_size()))
+	  return false;
+	chunk.chunk_id = next_chunk_in++;
+	return true;
+      },
+      [&] (Chunk& chunk, int tid) {
+	double start = omp_get_wtime();
+	mapGen.parse_chunk(chunk.input, chunk.sets);
 	chunk.thread_id = tid;
-
-#pragma omp critical(input)
-	{
-	  //omp_set_lock(&input_lock);
-	  for (load = 0; load < chunk_size; ++load) {
-	    local_m = mapGen.get_next();
-	    if (local_m == NULL) {
-	      break;
-	    }
-	    local_m_vector[load] = local_m;
-	  }
-
-	  chunk.chunk_id = next_chunk_in;
-	  if (load > 0)
-	    ++next_chunk_in;
-	  //omp_unset_lock(&input_lock);
+	chunk.out_str.clear();
+	chunk.err_str.str(string());
+	if (global::verbosity > 0) {
+	  chunk.err_str << "tid=" << tid << " chunk_id=" << chunk.chunk_id
+			<< " start:" << chunk.sets.front()->first
+			<< " end:" << chunk.sets.back()->first
+			<< '\n';
 	}
 
-	if (load == 0)
-	  break;
-
-	chunk.out_str = new stringstream();
-	chunk.err_str = new stringstream();
-	*chunk.err_str << "tid=" << tid << " chunk_id=" << chunk.chunk_id
-		       << " start:" << local_m_vector[0]->first
-		       << " end:" << local_m_vector[load - 1]->first
-		       << '\n';
-
-	for (int i = 0; i < load; ++i) {
-	  process_mapping_set(local_m_vector[i]->first, local_m_vector[i]->second,
-			      chunk.out_str);
-	  delete local_m_vector[i];
+	for (size_t i = 0; i < chunk.sets.size(); ++i) {
+	  process_mapping_set(chunk.sets[i]->first, chunk.sets[i]->second,
+			      &chunk.out_str);
+	  delete chunk.sets[i];
 	}
-
-#pragma omp critical(output)
-	{
-	  h.push(chunk);
-	  while (h.size() > 0) {
-	    chunk = h.top();
-	    assert(chunk.chunk_id >= next_chunk_out);
-	    if (chunk.chunk_id > next_chunk_out) {
-	      break;
-	    }
-
-	    cout << chunk.out_str->str();
-
-	    if (global::verbosity > 0) {
-	      cerr << "chunk=" << chunk.chunk_id << " work_thread=" << chunk.thread_id
-		   << " print_thread=" << tid << '\n';
-	      cerr << chunk.err_str->str();
-	      cerr.flush();
-	    }
-	    delete chunk.out_str;
-	    delete chunk.err_str;
-	    h.pop();
-	    ++next_chunk_out;
-	  }
+	chunk.work_seconds = omp_get_wtime() - start;
+      },
+      [&] (Chunk& chunk, int tid) {
+	tuner.chunk_done(chunk.sets.size(), chunk.input.n_bytes(), chunk.work_seconds);
+	out_writer.write(1, chunk.out_str);
+	if (global::verbosity > 0) {
+	  cerr << "chunk=" << chunk.chunk_id << " work_thread=" << chunk.thread_id
+	       << " print_thread=" << tid << '\n';
+	  cerr << chunk.err_str.str();
+	  cerr.flush();
 	}
-      }
-    }
-    //omp_destroy_lock(&input_lock);
+      });
+    if (global::verbosity > 0) tuner.print_stats(clog);
   }
 
+  if (global::verbosity > 0) mapGen.print_stats(clog);
+
   return 0;
 }